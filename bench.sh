@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# 用cc和gcc -O0/-O1分别编译bench/下的每个程序，先比较运行结果，
+# 再取RUNS次里最快的一次，输出每个程序相对gcc的耗时比例。
+# 输出格式固定，方便和以前的结果对比：
+#   <程序名> <cc ms> <gcc -O0 ms> <gcc -O1 ms> <cc/O0> <cc/O1>
+
+RUNS=${RUNS:-5}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+make -s cc || exit 1
+
+# 运行$1共RUNS次，输出最短的毫秒数
+function best_ms {
+	best=
+	for ((i = 0; i < RUNS; i++)); do
+		start=$(date +%s%N)
+		"$1" > /dev/null
+		end=$(date +%s%N)
+		t=$(( (end - start) / 1000 ))
+		if [ -z "$best" ] || [ "$t" -lt "$best" ]; then
+			best=$t
+		fi
+	done
+	awk "BEGIN { printf \"%.1f\", $best / 1000 }"
+}
+
+# 运行一次，输出返回值和标准输出
+function run_output {
+	out=$("$1")
+	echo "$? $out"
+}
+
+printf "%-12s %9s %9s %9s %7s %7s\n" "# kernel" "cc" "gcc-O0" "gcc-O1" "cc/O0" "cc/O1"
+status=0
+for src in bench/*.c; do
+	name=$(basename "$src" .c)
+	./cc < "$src" > "$dir/$name.s" || { echo "$name: cc failed"; status=1; continue; }
+	gcc -o "$dir/$name.cc" "$dir/$name.s" || { echo "$name: assemble failed"; status=1; continue; }
+	gcc -O0 -o "$dir/$name.O0" "$src" || { status=1; continue; }
+	gcc -O1 -o "$dir/$name.O1" "$src" || { status=1; continue; }
+
+	expected=$(run_output "$dir/$name.O0")
+	for v in cc O1; do
+		actual=$(run_output "$dir/$name.$v")
+		if [ "$actual" != "$expected" ]; then
+			echo "$name: $v output differs: got '$actual', expected '$expected'"
+			status=1
+			continue 2
+		fi
+	done
+
+	tcc=$(best_ms "$dir/$name.cc")
+	t0=$(best_ms "$dir/$name.O0")
+	t1=$(best_ms "$dir/$name.O1")
+	awk "BEGIN { printf \"%-12s %9.1f %9.1f %9.1f %7.2f %7.2f\n\", \"$name\", $tcc, $t0, $t1, $tcc / $t0, $tcc / $t1 }"
+done
+exit $status
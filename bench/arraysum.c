@@ -0,0 +1,27 @@
+int fill(int *p, int n, int v) {
+    if(n == 0) {
+        return 0;
+    }
+    *p = v;
+    return fill(p + 1, n - 1, (v * 17 + 3) % 1000);
+}
+
+int sum(int *p, int n) {
+    if(n == 0) {
+        return 0;
+    }
+    return *p + sum(p + 1, n - 1);
+}
+
+int rep(int *p, int n, int k) {
+    if(k == 1) {
+        return sum(p, n);
+    }
+    return (rep(p, n, k / 2) + rep(p, n, k - k / 2)) % 65521;
+}
+
+int main() {
+    int a[1000];
+    fill(a, 1000, 1);
+    return rep(a, 1000, 40000) % 256;
+}
@@ -0,0 +1,21 @@
+int steps(int n) {
+    if(n == 1) {
+        return 0;
+    }
+    if(n % 2 == 0) {
+        return 1 + steps(n / 2);
+    }
+    return 1 + steps(3 * n + 1);
+}
+
+int range(int lo, int hi) {
+    if(hi - lo < 2) {
+        return steps(lo);
+    }
+    int mid = (lo + hi) / 2;
+    return (range(lo, mid) + range(mid, hi)) % 1000000;
+}
+
+int main() {
+    return range(1, 100000) % 256;
+}
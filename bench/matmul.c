@@ -0,0 +1,29 @@
+int matmul(int *a, int *b, int *c, int n) {
+    for(int i = 0; i < n; i = i + 1) {
+        for(int j = 0; j < n; j = j + 1) {
+            int s = 0;
+            for(int k = 0; k < n; k = k + 1) {
+                s = s + *(a + i * n + k) * *(b + k * n + j);
+            }
+            *(c + i * n + j) = s;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    int a[10000];
+    int b[10000];
+    int c[10000];
+    int n = 100;
+    for(int i = 0; i < n * n; i = i + 1) {
+        *(a + i) = i % 7;
+        *(b + i) = i % 5;
+    }
+    int s = 0;
+    for(int r = 0; r < 10; r = r + 1) {
+        matmul(a, b, c, n);
+        s = (s + *(c + r * 101)) % 65521;
+    }
+    return s % 256;
+}
@@ -0,0 +1,25 @@
+int len(char *s) {
+    if(*s == 0) {
+        return 0;
+    }
+    return 1 + len(s + 1);
+}
+
+int count(char *s, char c) {
+    if(*s == 0) {
+        return 0;
+    }
+    return (*s == c) + count(s + 1, c);
+}
+
+int rep(char *s, int k) {
+    if(k == 1) {
+        return len(s) + count(s, 'a');
+    }
+    return (rep(s, k / 2) + rep(s, k - k / 2)) % 65521;
+}
+
+int main() {
+    char s[] = "a quick brown fox jumps over the lazy dog and a cat";
+    return rep(s, 400000) % 256;
+}
@@ -0,0 +1,29 @@
+int axpy(int *y, int *x, int n, int k) {
+    for(int i = 0; i < n; i = i + 1) {
+        *(y + i) = *(x + i) * k + *(y + i);
+    }
+    return 0;
+}
+
+int sum(int *x, int n) {
+    int s = 0;
+    for(int i = 0; i < n; i = i + 1) {
+        s = s + *(x + i);
+    }
+    return s;
+}
+
+int main() {
+    int x[4096];
+    int y[4096];
+    for(int i = 0; i < 4096; i = i + 1) {
+        *(x + i) = i % 13;
+        *(y + i) = 0;
+    }
+    int s = 0;
+    for(int r = 0; r < 5000; r = r + 1) {
+        axpy(y, x, 4096, r % 3);
+        s = (s + sum(y, 4096)) % 65521;
+    }
+    return s % 256;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "cc.h"
+
+// 编译缓存：键是编译器本身、影响输出的选项和输入的原文，散列以后当文件名。
+// 命中的时候直接输出上次的结果，不做词法和语法分析。每个条目一个文件：
+//   cc-cache 1
+//   <键的长度>\n<键>
+//   <头文件的个数>\n<散列> <长度> <路径>\n ...
+//   <输出的长度>\n<输出>
+// 文件名只有64位的散列，所以命中时还要比较整个键，头文件的内容也要和记下的一样。
+// 新条目先写临时文件再rename，别的进程看到的要么没有，要么是完整的。
+// 总大小超过上限就按修改时间删最旧的，命中时会更新修改时间，所以是LRU。
+// 头文件只记了找到的那个，-I前面的目录里后来新加了同名的文件是发现不了的。
+// 标准错误不存，所以编译时报了错误或者警告的结果不缓存，不然命中的时候诊断就没了
+
+#define CACHE_MAGIC "cc-cache 1\n"
+#define HASH_INIT 14695981039346656037ul
+#define ENTRY_NAME_LEN 16
+
+static char *cache_dir;
+static long cache_max;
+static String *key;
+static FILE *captured;      // 编译的时候标准输出先写到这里
+static int saved_stdout = -1;
+static FILE *captured_err;  // 标准错误也是，看编译的时候有没有诊断
+static int saved_stderr = -1;
+static bool diagnosed;
+
+static unsigned long hash_bytes(unsigned long h, char *p, long len) {
+    for(long i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 1099511628211ul;
+    return h;
+}
+
+static char *read_path(char *path, int *len) {
+    FILE *fp = fopen(path, "rb");
+    if(!fp)
+        return NULL;
+    char *r = read_source(fp, len);
+    fclose(fp);
+    return r;
+}
+
+static char *join(char *name) {
+    char *r = malloc(strlen(cache_dir) + strlen(name) + 2);
+    sprintf(r, "%s/%s", cache_dir, name);
+    return r;
+}
+
+static char *entry_path(void) {
+    char name[ENTRY_NAME_LEN + 1];
+    snprintf(name, sizeof(name), "%016lx", hash_bytes(HASH_INIT, key->body, key->len));
+    return join(name);
+}
+
+static bool is_entry_name(char *name) {
+    if(strlen(name) != ENTRY_NAME_LEN)
+        return false;
+    for(; *name; name++) {
+        if(!isxdigit((unsigned char)*name))
+            return false;
+    }
+    return true;
+}
+
+// 编译器换了，以前的结果就都不能用：把可执行文件本身算进键里
+void cache_open(char *dir, long max_size) {
+    cache_dir = dir;
+    cache_max = max_size;
+    mkdir(dir, 0777);
+    key = make_string();
+    int len;
+    char *exe = read_path("/proc/self/exe", &len);
+    if(exe)
+        string_appendf(key, "cc %016lx\n", hash_bytes(HASH_INIT, exe, len));
+    else
+        string_appendf(key, "cc %s %s\n", __DATE__, __TIME__);
+    free(exe);
+}
+
+// 带上长度，几段拼起来的键不会有歧义
+void cache_key(char *data, int len) {
+    string_appendf(key, "%d:", len);
+    for(int i = 0; i < len; i++)
+        string_append(key, data[i]);
+    string_append(key, '\n');
+}
+
+// 命中和没命中的次数，几个cc同时跑的时候靠flock串起来
+static void update_stats(bool hit) {
+    char *path = join("stats");
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    free(path);
+    if(fd < 0)
+        return;
+    flock(fd, LOCK_EX);
+    FILE *fp = fdopen(fd, "r+");
+    long hits = 0, misses = 0;
+    if(fscanf(fp, "hits %ld misses %ld", &hits, &misses) != 2)
+        hits = misses = 0;
+    if(hit)
+        hits++;
+    else
+        misses++;
+    rewind(fp);
+    fprintf(fp, "hits %ld misses %ld\n", hits, misses);
+    fflush(fp);
+    ftruncate(fd, ftell(fp));
+    flock(fd, LOCK_UN);
+    fclose(fp);
+}
+
+static long read_number(char **p, char *end) {
+    char *q;
+    long r = strtol(*p, &q, 10);
+    if(q == *p || q >= end || *q != '\n')
+        return -1;
+    *p = q + 1;
+    return r;
+}
+
+// 头文件的内容要和存的时候一样
+static bool check_deps(char **p, char *end) {
+    long ndeps = read_number(p, end);
+    if(ndeps < 0)
+        return false;
+    for(long i = 0; i < ndeps; i++) {
+        unsigned long hash;
+        int len, n;
+        if(sscanf(*p, "%lx %d %n", &hash, &len, &n) != 2)
+            return false;
+        char *path = *p + n;
+        char *nl = memchr(path, '\n', end - path);
+        if(!nl)
+            return false;
+        *nl = '\0';
+        *p = nl + 1;
+        int curlen;
+        char *cur = read_path(path, &curlen);
+        bool same = cur && curlen == len && hash_bytes(HASH_INIT, cur, curlen) == hash;
+        free(cur);
+        if(!same)
+            return false;
+    }
+    return true;
+}
+
+// 命中的话输出写到标准输出，返回true
+bool cache_lookup(void) {
+    char *path = entry_path();
+    int len = 0;
+    char *buf = read_path(path, &len);
+    char *end = buf + len;
+    char *p = buf;
+    bool hit = false;
+    if(buf && !strncmp(p, CACHE_MAGIC, strlen(CACHE_MAGIC))) {
+        p += strlen(CACHE_MAGIC);
+        long keylen = read_number(&p, end);
+        if(keylen == key->len && end - p >= keylen && !memcmp(p, key->body, keylen)) {
+            p += keylen;
+            long outlen;
+            if(check_deps(&p, end) && (outlen = read_number(&p, end)) >= 0 && end - p == outlen) {
+                fwrite(p, 1, outlen, stdout);
+                utime(path, NULL);
+                hit = true;
+            }
+        }
+    }
+    update_stats(hit);
+    free(buf);
+    free(path);
+    return hit;
+}
+
+// 把先存起来的标准错误写出去，编译到一半exit的时候也由atexit调用
+static void release_stderr(void) {
+    if(saved_stderr < 0)
+        return;
+    fflush(stderr);
+    dup2(saved_stderr, 2);
+    close(saved_stderr);
+    saved_stderr = -1;
+    rewind(captured_err);
+    int len;
+    char *err = read_source(captured_err, &len);
+    fclose(captured_err);
+    fwrite(err, 1, len, stderr);
+    diagnosed = len > 0;
+    free(err);
+}
+
+void cache_capture(void) {
+    fflush(stdout);
+    fflush(stderr);
+    captured = tmpfile();
+    captured_err = tmpfile();
+    saved_stdout = dup(1);
+    saved_stderr = dup(2);
+    if(!captured || !captured_err || saved_stdout < 0 || saved_stderr < 0) {
+        perror("cache");
+        exit(1);
+    }
+    dup2(fileno(captured), 1);
+    dup2(fileno(captured_err), 2);
+    atexit(release_stderr);
+}
+
+typedef struct {
+    char *name;
+    struct timespec mtime;
+    long size;
+} Entry;
+
+static int compare_entry(const void *a, const void *b) {
+    const Entry *x = a;
+    const Entry *y = b;
+    if(x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if(x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// 目录里所有的条目，返回个数，*total是总大小
+static int list_entries(Entry **entries, long *total) {
+    DIR *d = opendir(cache_dir);
+    int n = 0, nalloc = 0;
+    *entries = NULL;
+    *total = 0;
+    if(!d)
+        return 0;
+    struct dirent *de;
+    while((de = readdir(d))) {
+        if(!is_entry_name(de->d_name))
+            continue;
+        char *path = join(de->d_name);
+        struct stat st;
+        if(stat(path, &st) < 0) {
+            free(path);
+            continue;
+        }
+        if(n == nalloc) {
+            nalloc = nalloc ? nalloc * 2 : 64;
+            *entries = realloc(*entries, sizeof(Entry) * nalloc);
+        }
+        Entry e = {path, st.st_mtim, st.st_size};
+        (*entries)[n++] = e;
+        *total += st.st_size;
+    }
+    closedir(d);
+    return n;
+}
+
+static void evict(void) {
+    Entry *entries;
+    long total;
+    int n = list_entries(&entries, &total);
+    if(total > cache_max)
+        qsort(entries, n, sizeof(Entry), compare_entry);
+    for(int i = 0; i < n; i++) {
+        if(total > cache_max && !unlink(entries[i].name))
+            total -= entries[i].size;
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+// 恢复标准输出，把编译的输出写出去，再存成新的条目
+void cache_store(void) {
+    release_stderr();
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+    rewind(captured);
+    int outlen;
+    char *out = read_source(captured, &outlen);
+    fclose(captured);
+    fwrite(out, 1, outlen, stdout);
+    fflush(stdout);
+    if(diagnosed) {
+        free(out);
+        return;
+    }
+
+    char *tmp = join("tmp.XXXXXX");
+    int fd = mkstemp(tmp);
+    if(fd < 0) {
+        perror(tmp);
+        return;
+    }
+    FILE *fp = fdopen(fd, "w");
+    fprintf(fp, "%s%d\n", CACHE_MAGIC, key->len);
+    fwrite(key->body, 1, key->len, fp);
+    // 第一个是输入，已经在键里了
+    int nfiles;
+    SrcFile **files = source_files(&nfiles);
+    fprintf(fp, "%d\n", nfiles ? nfiles - 1 : 0);
+    for(int i = 1; i < nfiles; i++)
+        fprintf(fp, "%016lx %d %s\n", hash_bytes(HASH_INIT, files[i]->src, files[i]->len),
+                files[i]->len, files[i]->path);
+    fprintf(fp, "%d\n", outlen);
+    fwrite(out, 1, outlen, fp);
+    char *path = entry_path();
+    if(fclose(fp) || rename(tmp, path)) {
+        perror(path);
+        unlink(tmp);
+    }
+    free(path);
+    free(tmp);
+    free(out);
+    evict();
+}
+
+void cache_print_stats(char *dir) {
+    cache_dir = dir;
+    char *path = join("stats");
+    FILE *fp = fopen(path, "r");
+    long hits = 0, misses = 0;
+    if(fp) {
+        if(fscanf(fp, "hits %ld misses %ld", &hits, &misses) != 2)
+            hits = misses = 0;
+        fclose(fp);
+    }
+    free(path);
+    Entry *entries;
+    long total;
+    int n = list_entries(&entries, &total);
+    for(int i = 0; i < n; i++)
+        free(entries[i].name);
+    free(entries);
+    printf("hits %ld\nmisses %ld\nentries %d\nsize %ld\n", hits, misses, n, total);
+}
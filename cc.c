@@ -2,136 +2,56 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include "cc.h"
 
-#define MAX_ARGS 6
-#define EXPR_LEN 100
-
-enum {
-    AST_LITERAL,
-    AST_STRING,
-    AST_FUNCALL,
-    AST_DECL,
-    AST_ADDR,
-    AST_DEREF,
-    AST_LVAR,
-    AST_LREF,
-    AST_GVAR,
-    AST_GREF,
-    AST_ARRAY_INIT,
-    AST_IF,
-};
-
-enum {
-    CTYPE_VOID,
-    CTYPE_INT,
-    CTYPE_CHAR,
-    CTYPE_ARRAY,
-    CTYPE_STR,
-    CTYPE_PTR,
-};
-
-typedef struct Ctype {
-    int type;
-    struct Ctype *ptr;
-    int size;
-} Ctype;
-
-typedef struct Ast Ast;
-struct Ast {
-    char type;
-    Ctype *ctype;
-    Ast *next;
-    union {
-        // Integer
-        int ival;
-        // Char
-        char c;
-        // String
-        struct {
-            char *sval;
-            char *slabel;
-        };
-        // local variable
-        struct {
-            char *lname;
-            int loff;
-        };  
-        // global variable
-        struct {
-            char *gname;
-            char *glabel;
-        };
-        // local reference
-        struct {
-            struct Ast *lref;
-            int lrefoff;
-        };
-        // global reference
-        struct {
-            struct Ast *gref;
-            int goff;
-        };
-        // Binary operator
-        struct {
-            struct Ast *left;
-            struct Ast *right;
-        };
-        // Function call
-        struct {
-            char *fname;
-            int nargs;
-            struct Ast **args;
-        };
-        // Declaration
-        struct {
-            struct Ast *decl_var;
-            struct Ast *decl_init;
-        };
-        // Array init
-        struct {
-            int size;
-            struct Ast **array_init;
-        };
-        // Unary operator
-        struct {
-            struct Ast *operand;
-        };
-        // If statement
-        struct {
-            struct Ast *cond;
-            struct Ast **then;
-            struct Ast **els;
-        };
-    };
-};
-
-static Ast *vars = NULL;
-static Ast *strings = NULL;
 static Ast *globals = NULL;
 static Ast *locals = NULL;
+static Ast *locals_last = NULL;
+static Ast *funcs = NULL;
+static Ast *funcs_last = NULL;
+static bool in_func = false;
+static bool in_switch = false;  // break只能跳出switch，循环里不行
+
+// 字符串字面量池，按内容做开放寻址的哈希表
+static Ast **strpool = NULL;
+static int strpool_cap = 0;
+static int strpool_len = 0;
 
 static int labelseq = 0;
+static int nif = 0;
+
+// 名字到Ast的散列表，开放寻址
+typedef struct {
+    char **names;
+    Ast **asts;
+    int len;
+    int cap;
+} NameTable;
+
+static NameTable vartab;    // 当前的locals，同名的是最后声明的那个
+static NameTable functab;
 
-void emit_intexpr(Ast *ast);
-static Ast *read_symbol(char c);
-static Ast *read_string(void);
 static Ast *read_prim(void);
 static Ast *read_ident_or_func(char *c);
 static Ast *read_if_stmt(void);
+static Ast *read_while_stmt(void);
+static Ast *read_for_stmt(void);
+static Ast *read_switch_stmt(void);
 static Ast *read_expr(void);
+static Ast *read_unary_expr(void);
 static Ast *read_decl(void);
-static Ast *make_ast_up(Ast *init);
-static Ctype *result_type(char op, Ast *left, Ast *right);
+static Ast *make_ast_up(Ast *ast, int prec);
+static void expect(char punct);
+static Ctype *result_type(int op, Ast *left, Ast *right);
 static Ctype *make_ptr_type(Ctype* ctype);
 static Ctype *make_array_type(Ctype *ctype, int size);
-static int ctype_size(Ctype *ctype);
 
-static Ctype *ctype_int = &(Ctype){CTYPE_INT, NULL};
-static Ctype *ctype_char = &(Ctype){CTYPE_CHAR, NULL};
-static Ctype *ctype_str = &(Ctype){CTYPE_STR, NULL};
+static Ctype *ctype_int = &(Ctype){.type = CTYPE_INT};
+static Ctype *ctype_char = &(Ctype){.type = CTYPE_CHAR};
+static Ctype *ctype_str = &(Ctype){.type = CTYPE_STR};
 
-static Ast *make_ast_op(char type, Ast *left, Ast *right) {
+static Ast *make_ast_op(int type, Ast *left, Ast *right) {
     Ast *r = malloc(sizeof(Ast));
     r->type = type;
     r->ctype = result_type(type, left, right);
@@ -141,7 +61,7 @@ static Ast *make_ast_op(char type, Ast *left, Ast *right) {
     return r;
 }
 
-static char *make_next_label(void) {
+char *make_next_label(void) {
     String *s = make_string();
     string_appendf(s, ".L%d", labelseq++);
     return get_cstring(s);
@@ -156,81 +76,74 @@ static Ctype *make_array_type(Ctype *ctype, int size) {
     return r;
 }
 
+int ctype_size(Ctype *ctype) {
+    switch(ctype->type) {
+        case CTYPE_VOID:
+            return 0;
+        case CTYPE_CHAR:
+            return 1;
+        case CTYPE_INT:
+            return 4;
+        case CTYPE_ARRAY:
+            return ctype_size(ctype->ptr) * ctype->size;
+        default:
+            return 8;
+    }
+}
+
+static unsigned hash_string(char *p) {
+    unsigned h = 2166136261u;
+    for(; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+static void name_put(NameTable *t, char *name, Ast *ast);
+
 static Ast *ast_lvar(Ctype *ctype, char *name) {
     Ast *r = malloc(sizeof(Ast));
     r->type = AST_LVAR;
     r->ctype = ctype;
     r->lname = name;
+    r->loff = 0;
+    r->lver = 0;
+    r->lreg = 0;
     r->next = NULL;
 
-    if(locals) {
-        Ast *p;
-        for(p = locals; p->next; p = p->next);
-        p->next = r;
-    } else {
+    if(locals)
+        locals_last->next = r;
+    else
         locals = r;
-    }
+    locals_last = r;
+    name_put(&vartab, name, r);
 
     return r;
 }
 
-static Ast *ast_lref(Ctype *ctype, Ast *lvar, int off) {
+// blob末尾的0不占.rodata，生成代码时直接清零
+static Ast *ast_array_init(Ctype *ctype, char *blob, int nbytes) {
     Ast *r = malloc(sizeof(Ast));
-    r->type = AST_LREF;
-    r->ctype = ctype;
-    r->lref = lvar;
-    r->lrefoff = off;
-    return r;
-}
+    int elemsize = ctype_size(ctype->ptr);
+    while(nbytes > 0 && blob[nbytes - 1] == 0)
+        nbytes--;
+    nbytes = (nbytes + elemsize - 1) / elemsize * elemsize;
 
-static Ast *ast_gvar(Ctype *ctype, char *name, bool filelocal) {
-    Ast *r = malloc(sizeof(Ast));
-    r->type = AST_GVAR;
+    r->type = AST_ARRAY_INIT;
     r->ctype = ctype;
-    r->gname = name;
-    r->glabel = filelocal ? make_next_label() : name;
-    r->next = NULL;
-    if(globals) {
-        Ast *p;
-        for(p = locals; p->next; p = p->next);
-        p->next = r;
-    } else {
+    r->size = ctype->size;
+    r->nbytes = nbytes;
+    r->blob = blob;
+    r->blabel = NULL;
+    if(nbytes) {
+        r->blabel = make_next_label();
+        r->next = globals;
         globals = r;
     }
-    return r;
-}
 
-static Ast *ast_gref(Ctype *ctype, Ast *gvar, int off) {
-    Ast *r = malloc(sizeof(Ast));
-    r->type = AST_GREF;
-    r->ctype = ctype;
-    r->gref = gvar;
-    r->goff = off;
     return r;
 }
 
-static Ast *ast_string(char *str) {
-    Ast *r = malloc(sizeof(Ast));
-    r->type = AST_STRING;
-    r->ctype = make_array_type(ctype_char, strlen(str) +1);
-    r->sval = str;
-    r->slabel = make_next_label();
-    r->next = globals;
-    globals = r;
-    return r;
-}
-
-static Ast *ast_array_init(int size, Ast **array_init, Ctype *ctype) {
-    Ast *r = malloc(sizeof(Ast));
-    r->type = AST_ARRAY_INIT;
-    r->ctype = ctype;
-    r->size = size;
-    r->array_init = array_init;
-
-    return r;
-}
-
-static Ast *make_ast_uop(char type, Ctype *ctype, Ast *operand) {
+static Ast *make_ast_uop(int type, Ctype *ctype, Ast *operand) {
     Ast *r = malloc(sizeof(Ast));
     r->type = type;
     r->ctype = ctype;
@@ -261,31 +174,87 @@ static Ctype *make_ptr_type(Ctype *ctype) {
     return r;
 }
 
-static Ast *find_var(char *name) {
-    for(Ast *v = locals; v; v = v->next) {
-        if(!strcmp(name, v->lname)) {
-            return v;
+static Ast **name_slot(NameTable *t, char *name) {
+    unsigned h = hash_string(name) & (t->cap - 1);
+    while(t->names[h] && strcmp(t->names[h], name))
+        h = (h + 1) & (t->cap - 1);
+    t->names[h] = name;
+    return &t->asts[h];
+}
+
+// 已经有的就换掉
+static void name_put(NameTable *t, char *name, Ast *ast) {
+    if(t->len * 2 >= t->cap) {
+        NameTable old = *t;
+        t->cap = old.cap ? old.cap * 2 : 64;
+        t->names = calloc(t->cap, sizeof(char *));
+        t->asts = calloc(t->cap, sizeof(Ast *));
+        for(int i = 0; i < old.cap; i++) {
+            if(old.names[i])
+                *name_slot(t, old.names[i]) = old.asts[i];
         }
+        free(old.names);
+        free(old.asts);
     }
+    Ast **p = name_slot(t, name);
+    if(!*p)
+        t->len++;
+    *p = ast;
+}
 
+static Ast *name_get(NameTable *t, char *name) {
+    if(!t->cap)
+        return NULL;
+    unsigned h = hash_string(name) & (t->cap - 1);
+    for(; t->names[h]; h = (h + 1) & (t->cap - 1)) {
+        if(!strcmp(t->names[h], name))
+            return t->asts[h];
+    }
+    return NULL;
+}
+
+// 没有块作用域，同名的局部变量用最后声明的那个，
+// 这样接连几个for(int i = ...)各用各的i
+static Ast *find_var(char *name) {
+    Ast *r = name_get(&vartab, name);
+    if(r)
+        return r;
+
+    // globals里还挂着字符串和数组的初始数据，只看变量
     for(Ast *p = globals; p; p = p->next) {
-        if(!strcmp(name, p->gname))
+        if(p->type == AST_GVAR && !strcmp(name, p->gname))
             return p;
     }
 
     return NULL;
 }
 
+// 同名的用先定义的那个
+static Ast *find_func(char *name) {
+    return name_get(&functab, name);
+}
+
+static void add_func(Ast *func) {
+    func->next = NULL;
+    if(funcs)
+        funcs_last->next = func;
+    else
+        funcs = func;
+    funcs_last = func;
+    if(!find_func(func->func_name))
+        name_put(&functab, func->func_name, func);
+}
+
 static Ast * make_arg() {
-    Token *name = read_token();
-    // todo: 函数参数得需要有类型的
-    return read_prim();
+    return read_expr();
 }
 
+// 还没定义的函数按返回int处理
 static Ast *make_ast_funcall(char *fname, int nargs, Ast **args) {
     Ast *r = malloc(sizeof(Ast));
+    Ast *func = find_func(fname);
     r->type = AST_FUNCALL;
-    r->ctype = ctype_int;
+    r->ctype = func ? func->ctype : ctype_int;
     r->fname = fname;
     r->nargs = nargs;
     r->args = args;
@@ -293,7 +262,45 @@ static Ast *make_ast_funcall(char *fname, int nargs, Ast **args) {
     return r;
 }
 
+static Ast *make_ast_func(Ctype *rettype, char *fname, int nparams, Ast **params, Ast *localvars, Ast **body) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = AST_FUNC;
+    r->ctype = rettype;
+    r->func_name = fname;
+    r->nparams = nparams;
+    r->params = params;
+    r->localvars = localvars;
+    r->body = body;
+
+    return r;
+}
+
+static void strpool_grow(void) {
+    int oldcap = strpool_cap;
+    Ast **old = strpool;
+    strpool_cap = oldcap ? oldcap * 2 : 256;
+    strpool = calloc(strpool_cap, sizeof(Ast *));
+    for(int i = 0; i < oldcap; i++) {
+        if(!old[i])
+            continue;
+        unsigned h = hash_string(old[i]->sval) & (strpool_cap - 1);
+        while(strpool[h])
+            h = (h + 1) & (strpool_cap - 1);
+        strpool[h] = old[i];
+    }
+    free(old);
+}
+
+// 内容相同的字面量共用一个Ast，也就只有一个标签和一份.rodata
 static Ast *make_ast_string(char *str) {
+    if(strpool_len * 2 >= strpool_cap)
+        strpool_grow();
+    unsigned h = hash_string(str) & (strpool_cap - 1);
+    for(; strpool[h]; h = (h + 1) & (strpool_cap - 1)) {
+        if(!strcmp(strpool[h]->sval, str))
+            return strpool[h];
+    }
+
     Ast *r = malloc(sizeof(Ast));
     r->type = AST_STRING;
     r->ctype = ctype_str;
@@ -302,6 +309,8 @@ static Ast *make_ast_string(char *str) {
     r->next = globals;
 
     globals = r;
+    strpool[h] = r;
+    strpool_len++;
     return r;
 }
 
@@ -319,46 +328,93 @@ static Ast *ast_if(Ast *cond, Ast **then, Ast **els) {
     r->type = AST_IF;
     r->ctype = NULL;
     r->cond = cond;
+    r->then = then;
     r->els = els;
+    r->ifid = nif++;
     return r;
 }
 
+static Ast *ast_loop(int type, Ast *init, Ast *cond, Ast *step, Ast **body) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = type;
+    r->ctype = NULL;
+    r->forinit = init;
+    r->forcond = cond;
+    r->forstep = step;
+    r->forbody = body;
+    r->forpre = NULL;
+    r->forvec = false;
+    return r;
+}
+
+static Ast *ast_switch(Ast *cond, Ast **body, Ast **cases, int ncases, Ast *def) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = AST_SWITCH;
+    r->ctype = NULL;
+    r->swcond = cond;
+    r->swbody = body;
+    r->cases = cases;
+    r->ncases = ncases;
+    r->swdefault = def;
+    return r;
+}
+
+// AST_CASE、AST_DEFAULT和AST_BREAK
+static Ast *ast_label(int type, int val) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = type;
+    r->ctype = NULL;
+    r->caseval = val;
+    r->caselabel = NULL;
+    r->casejit = -1;
+    return r;
+}
+
+// 参数个数不限，超过MAX_ARGS的部分由gen放到栈上
 static Ast *read_func_args(char *fname) {
-    Ast **args = malloc(sizeof(Ast*) * (MAX_ARGS + 1));
-    int i = 0, nargs = 0;
-    for (; i < MAX_ARGS; i ++) {
-        Token *tok = read_token();
+    int nalloc = MAX_ARGS;
+    Ast **args = malloc(sizeof(Ast*) * nalloc);
+    int nargs = 0;
+    for (;;) {
+        Token tok = read_token();
         if(is_punct(tok, ')')) break;
         unget_token(tok);
-        args[i] = make_arg();
-        nargs++;
+        if(nargs == nalloc) {
+            nalloc *= 2;
+            args = realloc(args, sizeof(Ast*) * nalloc);
+        }
+        args[nargs++] = make_arg();
         tok = read_token();
         if(is_punct(tok, ')')) break;
-        if(!is_punct(tok, ','))
+        if(!is_punct(tok, ',')) {
             perror("unexcepted character");
+            break;
+        }
     }
 
     return make_ast_funcall(fname, nargs, args);
 }
 
 static Ast *read_ident_or_func(char* c) {
-    Token *token = read_token();
+    Token token = read_token();
     if(is_punct(token, '(')) { // 这里形如：'(a,b,c,d)', 说明是function
         return read_func_args(c);
     }
 
     unget_token(token);
     Ast *v = find_var(c);
+    if(!v)
+        printf("undefined variable: %s\n", c);
     return v;
 }
 
 static void ensure_lvalue(Ast *ast) {
-    if(ast->type != AST_LITERAL)
+    if(ast->type != AST_LVAR && ast->type != AST_GVAR && ast->type != AST_DEREF)
         perror("lvalue expected");
 }
 
 static Ast *read_unary_expr(void) {
-    Token *token = read_token();
+    Token token = read_token();
     if(is_punct(token, '&')) {
         Ast *operand = read_unary_expr();
         ensure_lvalue(operand);
@@ -371,23 +427,32 @@ static Ast *read_unary_expr(void) {
 
         return make_ast_uop(AST_DEREF, operand->ctype->ptr, operand);
     }
+    if(is_punct(token, '!'))
+        return make_ast_uop('!', ctype_int, read_unary_expr());
     unget_token(token);
     return read_prim();
 }
 
 static Ast *read_prim(void) {
-    Token *token = read_token();
-    switch(token->type) {
+    Token token = read_token();
+    switch(token.type) {
+        case TTYPE_EOF:
+            return NULL;
         case TTYPE_IDENT:
-            return read_ident_or_func(token->sval);
+            return read_ident_or_func(token_ident(token));
         case TTYPE_INT:
-            return make_ast_int(token->ival);
+            return make_ast_int(token.ival);
         case TTYPE_CHAR:
-            return make_ast_char(token->c);
+            return make_ast_char(token.c);
         case TTYPE_STRING:
-            return make_ast_string(token->sval);
+            return make_ast_string(token_string(token));
         case TTYPE_PUNCT:
-            printf("unexpected character:%c\n", token->punct);
+            if(token.punct == '(') {
+                Ast *r = read_expr();
+                expect(')');
+                return r;
+            }
+            printf("unexpected character:%c\n", token.punct);
             return NULL;
         default:
             printf("internal error token\n");
@@ -395,131 +460,238 @@ static Ast *read_prim(void) {
     }
 }
 
-static int get_priority(char op) {
+static int get_priority(int op) {
     switch(op) {
         case '=':
             return 1;
-        case '+': case '-':
+        case PUNCT_LOGOR:
             return 2;
-        case '*': case '/':
+        case PUNCT_LOGAND:
             return 3;
+        case PUNCT_EQ: case PUNCT_NE:
+            return 4;
+        case '<': case '>': case PUNCT_LE: case PUNCT_GE:
+            return 5;
+        case '+': case '-':
+            return 6;
+        case '*': case '/': case '%':
+            return 7;
         default:
             return -1;
-    } 
+    }
 }
 
-static Ctype *get_ctype(Token *token) {
-    if(token->type != TTYPE_IDENT) 
-        return NULL;
-    if(!strcmp(token->sval, "int")){
+static Ctype *get_ctype(Token token) {
+    if(is_ident(token, "int"))
         return ctype_int;
-    }
-    if(!strcmp(token->sval, "char"))
+    if(is_ident(token, "char"))
         return ctype_char;
-    if(!strcmp(token->sval, "string"))
+    if(is_ident(token, "string"))
         return ctype_str;
 
     return NULL;
 }
 
-static bool is_type_keyword(Token *token) {
+static bool is_type_keyword(Token token) {
     return get_ctype(token) != NULL ;
 }
 
 
 static void expect(char punct) {
-    Token *token = read_token();
-    if(!is_punct(token, punct)) 
+    Token token = read_token();
+    if(!is_punct(token, punct))
         printf("'%c' expected", punct);
 }
 
-static char next_punct() {
-    Token *token = read_token();
-    if(token->type == TTYPE_PUNCT)
-        return token->punct;
-    else {
+// 语句以';'结束，最后一条语句可以省略
+static void expect_stmt_end(void) {
+    Token token = read_token();
+    if(token.type != TTYPE_EOF && !is_punct(token, ';')) {
+        printf("';' expected");
         unget_token(token);
-        return (char)0;
     }
 }
 
-static Ast *read_decl_array_initializer(Ctype *ctype) {
-    Token *token = read_token();
-    if(is_punct(token, '"')) {
+static int eval_intexpr(Ast *ast) {
+    switch(ast->type) {
+        case AST_LITERAL:
+            return ast->ctype->type == CTYPE_CHAR ? ast->c : ast->ival;
+        case '+':
+            return eval_intexpr(ast->left) + eval_intexpr(ast->right);
+        case '-':
+            return eval_intexpr(ast->left) - eval_intexpr(ast->right);
+        case '*':
+            return eval_intexpr(ast->left) * eval_intexpr(ast->right);
+        case '/':
+        case '%': {
+            int right = eval_intexpr(ast->right);
+            if(right == 0) {
+                perror("division by zero");
+                return 0;
+            }
+            if(ast->type == '%')
+                return eval_intexpr(ast->left) % right;
+            return eval_intexpr(ast->left) / right;
+        }
+        default:
+            perror("constant expression expected");
+            return 0;
+    }
+}
+
+static int read_array_elem(void) {
+    Token token = read_token();
+    if(token.type != TTYPE_INT && token.type != TTYPE_CHAR) {
+        unget_token(token);
+        return eval_intexpr(read_expr());
+    }
+    // 常见的数字表格不用建Ast，直接取值。token已经读掉了，
+    // 后面还有运算符的时候从这个字面量接着往上读
+    Token next = peek_token();
+    if(is_punct(next, ',') || is_punct(next, '}'))
+        return token.type == TTYPE_INT ? token.ival : token.c;
+    Ast *lit = token.type == TTYPE_INT ? make_ast_int(token.ival) : make_ast_char(token.c);
+    return eval_intexpr(make_ast_up(lit, 0));
+}
 
+// 初始值在编译期求出来，按元素大小写进一段连续的blob
+static Ast *read_decl_array_initializer(Ctype *ctype) {
+    Token token = read_token();
+    int elemsize = ctype_size(ctype->ptr);
+
+    if(token.type == TTYPE_STRING) {
+        if(ctype->ptr->type != CTYPE_CHAR)
+            perror("char array expected");
+        char *str = token_string(token);
+        int len = strlen(str) + 1;
+        if(ctype->size < 0)
+            ctype->size = len;
+        if(len - 1 > ctype->size)
+            perror("initializer string is too long");
+        if(len > ctype->size)
+            len = ctype->size;
+        return ast_array_init(ctype, str, len);
+    }
+    if(!is_punct(token, '{')) {
+        perror("'{' expected");
+        return NULL;
     }
-    if(is_punct(token, '{')) {
-        printf("%s\n", "read_decl_array_initializer");
-        printf("size::::%d\n", ctype->size);
-        Ast **init = malloc(sizeof(Ast) * ctype->size);
 
-        for(int i = 0; i < ctype->size; i++) {
-            Ast *a = read_prim();
-            init[i] = make_ast_up(a);
-            // todo 校验type类型
-            Token *next = read_token();
+    int nalloc = ctype->size > 0 ? ctype->size : 16;
+    char *blob = calloc(nalloc, elemsize);
+    int n = 0;
+    for(;;) {
+        token = read_token();
+        if(is_punct(token, '}'))
+            break;
+        unget_token(token);
 
-            if(is_punct(next, '}')) {
-                printf("%s\n", "finise");
-                if(ctype->size == i) {
-                    break;
-                }
-            } else {
-                unget_token(next);
+        long val = read_array_elem();
+        if(n == nalloc) {
+            if(ctype->size > 0) {
+                perror("too many array initializers");
+                break;
             }
+            blob = realloc(blob, nalloc * 2 * elemsize);
+            memset(blob + nalloc * elemsize, 0, nalloc * elemsize);
+            nalloc *= 2;
         }
+        memcpy(blob + n * elemsize, &val, elemsize);
+        n++;
 
-        return ast_array_init(ctype->size, init, ctype);
+        token = read_token();
+        if(is_punct(token, '}'))
+            break;
+        if(!is_punct(token, ',')) {
+            perror("',' expected");
+            break;
+        }
     }
 
-    return NULL;
+    if(ctype->size < 0)
+        ctype->size = n;
+    return ast_array_init(ctype, blob, n * elemsize);
 }
 
 static Ast *read_stmt(void) {
-    Token *token = read_token();
-    if(token->type == TTYPE_IDENT && !strcmp(token->sval, "if")) {
-        printf("%s\n", "read_if_stmt");
+    Token token = read_token();
+    if(is_ident(token, "if")) {
         return read_if_stmt();
     }
-        
+    if(is_ident(token, "while")) {
+        return read_while_stmt();
+    }
+    if(is_ident(token, "for")) {
+        return read_for_stmt();
+    }
+    if(is_ident(token, "switch")) {
+        return read_switch_stmt();
+    }
+    if(is_ident(token, "break")) {
+        if(!in_switch)
+            perror("break statement not within switch");
+        expect_stmt_end();
+        return ast_label(AST_BREAK, 0);
+    }
+    // case只能直接写在switch的{}里
+    if(is_ident(token, "case") || is_ident(token, "default")) {
+        perror("case label not within switch");
+        if(is_ident(token, "case"))
+            read_expr();
+        expect(':');
+        return make_ast_int(0);
+    }
+    if(is_ident(token, "return")) {
+        Ast *r = make_ast_uop(AST_RETURN, NULL, read_expr());
+        expect_stmt_end();
+        return r;
+    }
+
     unget_token(token);
-    Ast *r = read_prim();
-    r = make_ast_up(r);
+    Ast *r = read_expr();
+    expect_stmt_end();
 
     return r;
 }
 
 static Ast *read_decl_or_stmt(void) {
-    Token *token = peek_token();
-    if(!token) return NULL;
-    printf("%s\n", "read_null");
+    Token token = peek_token();
+    if(token.type == TTYPE_EOF) return NULL;
     return is_type_keyword(token) ? read_decl() : read_stmt();
 }
 
+// 读到'}'或者文件结束为止，'}'留给调用方。
+// 大多数块只有几条语句，数组从小的开始倍增，函数多的时候不白占内存
 static Ast **read_block(void) {
-    Ast **stmts = malloc(sizeof(Ast **) * EXPR_LEN);
+    int nalloc = 8;
+    Ast **stmts = malloc(sizeof(Ast *) * nalloc);
     int i;
-    for(i = 0; i < EXPR_LEN - 1; i ++) {
+    for(i = 0;; i ++) {
+        Token to = peek_token();
+        if(to.type == TTYPE_EOF || is_punct(to, '}'))
+            break;
+        if(i == nalloc - 1) {
+            nalloc *= 2;
+            stmts = realloc(stmts, sizeof(Ast *) * nalloc);
+        }
         stmts[i] = read_decl_or_stmt();
-        Token *to = peek_token();
-        if(!stmts[i] || is_punct(to, '}'))
+        if(!stmts[i])
             break;
     }
-    stmts[i + 1] = NULL;
+    stmts[i] = NULL;
     return stmts;
 }
 
 static Ast *read_if_stmt(void) {
     expect('(');
-    Ast *cond = read_prim();
-    cond = make_ast_up(cond);
+    Ast *cond = read_expr();
     expect(')');
     expect('{');
     Ast **then = read_block();
     expect('}');
 
-    Token *tok = read_token();
-    if(!tok  || tok->type != TTYPE_IDENT || strcmp(tok->sval, "else")) {
+    Token tok = read_token();
+    if(!is_ident(tok, "else")) {
         unget_token(tok);
         return ast_if(cond, then, NULL);
     }
@@ -530,85 +702,283 @@ static Ast *read_if_stmt(void) {
     return ast_if(cond, then, els);
 }
 
+// 循环体里的break没有支持，外面的switch也跳不出去
+static Ast **read_loop_body(void) {
+    bool saved = in_switch;
+    in_switch = false;
+    expect('{');
+    Ast **body = read_block();
+    expect('}');
+    in_switch = saved;
+    return body;
+}
 
-static Ast *read_decl(void) {
-    Ast *init;
+static Ast *read_while_stmt(void) {
+    expect('(');
+    Ast *cond = read_expr();
+    expect(')');
+    Ast **body = read_loop_body();
+    return ast_loop(AST_WHILE, NULL, cond, NULL, body);
+}
+
+// for的三个部分都可以不写，初始化的部分也可以是声明
+static Ast *read_for_stmt(void) {
+    Ast *init = NULL, *cond = NULL, *step = NULL;
+    expect('(');
+    if(is_type_keyword(peek_token())) {
+        init = read_decl();
+    } else {
+        if(!is_punct(peek_token(), ';'))
+            init = read_expr();
+        expect(';');
+    }
+    if(!is_punct(peek_token(), ';'))
+        cond = read_expr();
+    expect(';');
+    if(!is_punct(peek_token(), ')'))
+        step = read_expr();
+    expect(')');
+    Ast **body = read_loop_body();
+    return ast_loop(AST_FOR, init, cond, step, body);
+}
+
+static int compare_case(const void *a, const void *b) {
+    int x = (*(Ast **)a)->caseval;
+    int y = (*(Ast **)b)->caseval;
+    return x < y ? -1 : x > y;
+}
 
-    Ctype *ctype = get_ctype(read_token());
-    Token *token;
+// case和default直接写在{}里，跳进来的位置就是它们在swbody里的位置
+static Ast *read_switch_stmt(void) {
+    expect('(');
+    Ast *cond = read_expr();
+    expect(')');
+    if(cond && cond->ctype->type != CTYPE_INT && cond->ctype->type != CTYPE_CHAR)
+        perror("switch quantity is not an integer");
+    expect('{');
+    bool saved = in_switch;
+    in_switch = true;
+    // 和read_block一样从小的开始倍增
+    int nalloc = 8;
+    Ast **body = malloc(sizeof(Ast *) * nalloc);
+    int n = 0;
+    int cases_alloc = 8;
+    Ast **cases = malloc(sizeof(Ast *) * cases_alloc);
+    int ncases = 0;
+    Ast *def = NULL;
+    for(;;) {
+        Token tok = peek_token();
+        if(tok.type == TTYPE_EOF || is_punct(tok, '}'))
+            break;
+        Ast *stmt;
+        if(is_ident(tok, "case")) {
+            read_token();
+            Ast *val = read_expr();
+            long v = 0;
+            if(!val || !eval_const(val, &v))
+                perror("case label is not a constant");
+            expect(':');
+            stmt = ast_label(AST_CASE, (int)v);
+            if(ncases == cases_alloc) {
+                cases_alloc *= 2;
+                cases = realloc(cases, sizeof(Ast *) * cases_alloc);
+            }
+            cases[ncases++] = stmt;
+        } else if(is_ident(tok, "default")) {
+            read_token();
+            expect(':');
+            if(def)
+                perror("multiple default labels in one switch");
+            stmt = def = ast_label(AST_DEFAULT, 0);
+        } else {
+            stmt = read_decl_or_stmt();
+            if(!stmt)
+                break;
+        }
+        if(n == nalloc - 1) {
+            nalloc *= 2;
+            body = realloc(body, sizeof(Ast *) * nalloc);
+        }
+        body[n++] = stmt;
+    }
+    body[n] = NULL;
+    expect('}');
+    in_switch = saved;
+    qsort(cases, ncases, sizeof(Ast *), compare_case);
+    for(int i = 1; i < ncases; i++) {
+        if(cases[i]->caseval == cases[i - 1]->caseval)
+            perror("duplicate case value");
+    }
+    return ast_switch(cond, body, cases, ncases, def);
+}
+
+
+// 读类型和变量名，例如"int **p"
+static bool read_declarator(Ctype **ctype, Token *name) {
+    *ctype = get_ctype(read_token());
+    Token token;
     for(;;) {
         token = read_token();
         if(!is_punct(token, '*'))
             break;
-        ctype = make_ptr_type(ctype);
+        *ctype = make_ptr_type(*ctype);
     }
 
-    if(token->type != TTYPE_IDENT) {
+    if(token.type != TTYPE_IDENT) {
         printf("Identifier expected");
-        return NULL;
+        return false;
     }
+    *name = token;
+    return true;
+}
 
-    char next_p = next_punct();
-    if(next_p) {
-        if(next_p == '=') {
-            Ast *left = read_prim();
-            init = make_ast_up(left);
-
-            return make_ast_decl(left, init, ctype);
-        } else if(next_p == ';') { // 没有初始值的申明
-            Ast *left = read_prim();
-            return make_ast_decl(left, init, ctype);
-        } else if(next_p == '[') { // 数组
-            // 先读取数字
-            Token *num = read_token();
-            Ctype *array_type = make_array_type(ctype, num->ival);
-            Ast *var = ast_lvar(ctype, token->sval);
-            printf("read_array size: %d\n", num->ival);
-            expect(']');
-            expect('='); // 这里暂时只支持一元数组
-            return make_ast_decl(var, read_decl_array_initializer(array_type), ctype);
+static Ast **read_func_params(int *nparams) {
+    int nalloc = MAX_ARGS;
+    Ast **params = malloc(sizeof(Ast *) * nalloc);
+    int n = 0;
+    Token tok = read_token();
+    if(is_punct(tok, ')')) {
+        *nparams = 0;
+        return params;
+    }
+    unget_token(tok);
+    for(;;) {
+        Ctype *ctype;
+        Token name;
+        if(!read_declarator(&ctype, &name))
+            break;
+        if(n == nalloc) {
+            nalloc *= 2;
+            params = realloc(params, sizeof(Ast *) * nalloc);
+        }
+        params[n++] = ast_lvar(ctype, token_ident(name));
+        tok = read_token();
+        if(is_punct(tok, ')'))
+            break;
+        if(!is_punct(tok, ',')) {
+            printf("',' expected");
+            break;
         }
+    }
+    *nparams = n;
+    return params;
+}
+
+// 每个函数有自己的locals，参数也在里面
+static Ast *read_func_def(Ctype *rettype, char *fname) {
+    if(in_func) {
+        perror("function definition is not allowed here");
         return NULL;
-    } else {
-        perror("expected punct!!!!!");
+    }
+    Ast *saved = locals;
+    Ast *saved_last = locals_last;
+    NameTable saved_vars = vartab;
+    locals = locals_last = NULL;
+    vartab = (NameTable){NULL, NULL, 0, 0};
+    in_func = true;
+    bool saved_switch = in_switch;
+    in_switch = false;
+
+    int nparams;
+    Ast **params = read_func_params(&nparams);
+    Ast *r = make_ast_func(rettype, fname, nparams, params, NULL, NULL);
+    add_func(r);
+    expect('{');
+    r->body = read_block();
+    expect('}');
+    r->localvars = locals;
+
+    free(vartab.names);
+    free(vartab.asts);
+    vartab = saved_vars;
+    locals = saved;
+    locals_last = saved_last;
+    in_func = false;
+    in_switch = saved_switch;
+    return r;
+}
+
+static Ast *read_decl(void) {
+    Ast *init = NULL;
+    Ctype *ctype;
+    Token token;
+    if(!read_declarator(&ctype, &token))
         return NULL;
+
+    Token next = read_token();
+    if(is_punct(next, '('))
+        return read_func_def(ctype, token_ident(token));
+    if(is_punct(next, '[')) { // 数组，这里暂时只支持一维数组
+        // 没写长度的时候由初始值决定
+        Token num = read_token();
+        int size = -1;
+        if(num.type == TTYPE_INT)
+            size = num.ival;
+        else
+            unget_token(num);
+        expect(']');
+        ctype = make_array_type(ctype, size);
+        next = read_token();
     }
 
-    return NULL;
+    Ast *var = ast_lvar(ctype, token_ident(token));
+    if(is_punct(next, '=')) {
+        if(ctype->type == CTYPE_ARRAY)
+            init = read_decl_array_initializer(ctype);
+        else
+            init = read_expr();
+    } else {
+        unget_token(next);
+    }
+    if(ctype->type == CTYPE_ARRAY && ctype->size < 0)
+        perror("array size missing");
+    expect_stmt_end();
+
+    return make_ast_decl(var, init, ctype);
+}
+
+bool is_compare_op(int op) {
+    switch(op) {
+        case '<': case '>': case PUNCT_EQ: case PUNCT_NE: case PUNCT_LE: case PUNCT_GE:
+            return true;
+        default:
+            return false;
+    }
 }
 
-static Ctype *result_type(char op, Ast *left, Ast *right) {
-    Ast *var_str;
+static Ctype *result_type(int op, Ast *left, Ast *right) {
+    if(op == '=')
+        return left->ctype;
+    if(is_compare_op(op) || op == PUNCT_LOGAND || op == PUNCT_LOGOR)
+        return ctype_int;
 
     switch(left->ctype->type) {
         case CTYPE_VOID:
             goto err;
         case CTYPE_INT:
+        case CTYPE_CHAR:
             switch(right->ctype->type) {
                 case CTYPE_INT:
                 case CTYPE_CHAR:
                     return ctype_int;
+                case CTYPE_PTR:
+                case CTYPE_ARRAY:
                 case CTYPE_STR:
+                    if(op == '+')
+                        return result_type(op, right, left);
                     goto err;
             }
             break;
-        case CTYPE_CHAR:
-            switch(right->ctype->type) {
-                case CTYPE_CHAR:
-                    return ctype_char;
-                case CTYPE_STR:
-                case CTYPE_INT:
-                    goto err;
-            }
-            break;
+        case CTYPE_PTR:
+        case CTYPE_ARRAY:
         case CTYPE_STR:
-            var_str = find_var(left->sval);
-            printf("var_str:%s", left->sval);
-            if(var_str) {
-                printf("sssssss");
-            }
-            return ctype_str;
-            // goto err;
+            if(op != '+' && op != '-')
+                goto err;
+            if(right->ctype->type != CTYPE_INT && right->ctype->type != CTYPE_CHAR)
+                goto err;
+            if(left->ctype->type == CTYPE_ARRAY)
+                return make_ptr_type(left->ctype->ptr);
+            return left->ctype;
         default:
             perror("internal error!");
 
@@ -619,38 +989,119 @@ static Ctype *result_type(char op, Ast *left, Ast *right) {
         return NULL;
 }
 
-static Ast *make_ast_up(Ast *ast) {
-
-    Token *type = read_token();
-    if (type == NULL || is_punct(type, ';') || is_punct(type, ',') || is_punct(type, '}')) {
-        if(is_punct(type, '}')) {
-            unget_token(type);
-        }
+static bool is_right_assoc(int op) {
+    return op == '=';
+}
 
-        return ast;
-    }
-    int c = type->punct;
-    if(get_priority(c) < 0) {
-        unget_token(type);
-        return ast;
+// 一串同一优先级的左结合运算：terms[0] ops[0] terms[1] ops[1] ...
+typedef struct {
+    Ast **terms;
+    int *ops;
+    int n;
+    int cap;
+} Chain;
+
+#define BALANCE_MIN 16
+
+static void chain_push(Chain *ch, int op, Ast *term) {
+    if(ch->n == ch->cap) {
+        ch->cap = ch->cap ? ch->cap * 2 : 16;
+        ch->terms = realloc(ch->terms, sizeof(Ast *) * ch->cap);
+        ch->ops = realloc(ch->ops, sizeof(int) * ch->cap);
     }
+    ch->ops[ch->n] = op;
+    ch->terms[ch->n++] = term;
+}
 
-    Ast *right = read_prim();
-    Token *next_op = read_token();
+// terms[lo..hi]的和，符号都相对terms[lo]的：
+// 后半段的第一项和terms[lo]同号就加，否则减
+static Ast *chain_balance(Chain *ch, int lo, int hi) {
+    if(lo == hi)
+        return ch->terms[lo];
+    int mid = (lo + hi) / 2;
+    Ast *left = chain_balance(ch, lo, mid);
+    Ast *right = chain_balance(ch, mid + 1, hi);
+    int op = ch->ops[1];
+    if(op != '*') {
+        bool neg_lo = lo && ch->ops[lo] == '-';
+        bool neg_mid = ch->ops[mid + 1] == '-';
+        op = neg_lo == neg_mid ? '+' : '-';
+    }
+    return make_ast_op(op, left, right);
+}
 
-    if (next_op == NULL || get_priority(c) >= get_priority(next_op->punct)) {
-        if(next_op)
-            unget_token(next_op);    
-        return make_ast_up(make_ast_op(c, ast, right));
+// int的+ -和*按2的32次方取模，怎么结合结果都一样。
+// 很长的一串建成平衡的树，后面递归遍历Ast的深度就是对数的
+static Ast *chain_flush(Chain *ch) {
+    bool balance = ch->n >= BALANCE_MIN;
+    for(int i = 0; balance && i < ch->n; i++) {
+        Ast *t = ch->terms[i];
+        if(!t || (t->ctype->type != CTYPE_INT && t->ctype->type != CTYPE_CHAR))
+            balance = false;
+        else if(i && (ch->ops[i] == '*') != (ch->ops[1] == '*'))
+            balance = false;
+        else if(i && ch->ops[i] != '+' && ch->ops[i] != '-' && ch->ops[i] != '*')
+            balance = false;
+    }
+    Ast *r;
+    if(balance) {
+        r = chain_balance(ch, 0, ch->n - 1);
     } else {
-        unget_token(next_op);
-        return make_ast_up(make_ast_op(c, ast, make_ast_up(right)));
+        r = ch->terms[0];
+        for(int i = 1; i < ch->n; i++)
+            r = make_ast_op(ch->ops[i], r, ch->terms[i]);
+    }
+    ch->n = 0;
+    return r;
+}
+
+// 优先级爬升：把优先级不低于prec的运算符都结合到ast上。
+// 同一优先级的左结合运算先攒在chain里，优先级变了再建树
+static Ast *make_ast_up(Ast *ast, int prec) {
+    Chain ch = {NULL, NULL, 0, 0};
+    int chain_prec = -1;
+    for(;;) {
+        Token type = read_token();
+        int c = type.punct;
+        int prec2 = type.type == TTYPE_PUNCT ? get_priority(c) : -1;
+        if(prec2 < 0 || prec2 < prec) {
+            unget_token(type);
+            break;
+        }
+        if(ch.n && prec2 != chain_prec)
+            ast = chain_flush(&ch);
+        if(c == '=')
+            ensure_lvalue(ast);
+
+        Ast *right = make_ast_up(read_unary_expr(), is_right_assoc(c) ? prec2 : prec2 + 1);
+        if(is_right_assoc(c)) {
+            ast = make_ast_op(c, ast, right);
+            continue;
+        }
+        if(!ch.n) {
+            chain_push(&ch, 0, ast);
+            chain_prec = prec2;
+        }
+        chain_push(&ch, c, right);
     }
+    if(ch.n)
+        ast = chain_flush(&ch);
+    free(ch.terms);
+    free(ch.ops);
+    return ast;
+}
+
+static Ast *read_expr(void) {
+    Ast *ast = read_unary_expr();
+    if(!ast)
+        return NULL;
+    return make_ast_up(ast, 0);
 }
 
 static char *ctype_to_string(Ctype *ctype) {
+    String *s;
     switch(ctype->type) {
-        case CTYPE_VOID: 
+        case CTYPE_VOID:
             return "void";
         case CTYPE_INT:
             return "int";
@@ -658,8 +1109,14 @@ static char *ctype_to_string(Ctype *ctype) {
             return "char";
         case CTYPE_STR:
             return "string";
+        case CTYPE_PTR:
+            s = make_string();
+            string_appendf(s, "%s*", ctype_to_string(ctype->ptr));
+            return get_cstring(s);
         case CTYPE_ARRAY:
-            return "int[3]";
+            s = make_string();
+            string_appendf(s, "%s[%d]", ctype_to_string(ctype->ptr), ctype->size);
+            return get_cstring(s);
         default:
             printf("Unknown ctype: %d", ctype->type);
             return NULL;
@@ -668,26 +1125,49 @@ static char *ctype_to_string(Ctype *ctype) {
 
 static void print_quote(char *p) {
     while(*p) {
-        if(*p == '\"' || *p == '\\') 
+        if(*p == '\"' || *p == '\\')
             printf("\\");
         printf("%c", *p);
         p++;
     }
 }
 
-char *block_to_string(Ast **block) {
-    String *s = make_string();
-    string_appendf(s, "{");
-    for(int i = 0; block[i]; i++) {
+static void print_ast(Ast *ast);
 
-    }
+static char *op_to_string(int op) {
+    Token tok = {TTYPE_PUNCT, .punct = op};
+    return token_to_string(tok);
+}
 
-    return NULL;
+// for里省略的部分输出成"()"
+static void print_opt_ast(Ast *ast) {
+    if(ast)
+        print_ast(ast);
+    else
+        printf("()");
+}
+
+static void print_block(Ast **block) {
+    printf("{");
+    for(int i = 0; block[i]; i++) {
+        print_ast(block[i]);
+        printf(";");
+    }
+    printf("}");
 }
 
 static void print_ast(Ast *ast) {
-    
+
 	switch(ast->type) {
+        case '<': case '>': case PUNCT_EQ: case PUNCT_NE: case PUNCT_LE: case PUNCT_GE:
+        case PUNCT_LOGAND: case PUNCT_LOGOR:
+            printf("(%s ", op_to_string(ast->type));
+            goto printf_op;
+        case '!':
+            printf("(! ");
+            print_ast(ast->operand);
+            printf(")");
+            break;
 		case '+':
 			printf("(+ ");
 			goto printf_op;
@@ -700,6 +1180,9 @@ static void print_ast(Ast *ast) {
         case '/':
             printf("(/ ");
             goto printf_op;
+        case '%':
+            printf("(%% ");
+            goto printf_op;
         case '=':
             printf("(=");
             goto printf_op;
@@ -709,8 +1192,8 @@ static void print_ast(Ast *ast) {
                 if(ast->args[i]) {
                     print_ast(ast->args[i]);
                 }
-                
-                if(ast->args[i + 1])
+
+                if(i + 1 < ast->nargs)
                     printf(",");
             }
             printf(")");
@@ -727,28 +1210,110 @@ static void print_ast(Ast *ast) {
 			printf(")");
 			break;
 		case AST_LITERAL:
-			printf("%d", ast->ival);
+            if(ast->ctype->type == CTYPE_CHAR)
+                printf("'%c'", ast->c);
+            else
+                printf("%d", ast->ival);
 			break;
+        case AST_LVAR:
+            printf("%s", ast->lname);
+            break;
+        case AST_GVAR:
+            printf("%s", ast->gname);
+            break;
+        case AST_ADDR:
+            printf("(& ");
+            print_ast(ast->operand);
+            printf(")");
+            break;
+        case AST_DEREF:
+            printf("(* ");
+            print_ast(ast->operand);
+            printf(")");
+            break;
         case AST_DECL:
             printf("(decl %s %s ",
                 ctype_to_string(ast->decl_var->ctype),
-                ast->decl_var->sval);
+                ast->decl_var->lname);
             if(ast->decl_init)
                 print_ast(ast->decl_init);
             printf(")");
             break;
-        case AST_ARRAY_INIT:
+        case AST_ARRAY_INIT: {
+            int elemsize = ctype_size(ast->ctype->ptr);
             printf("{");
-            for(int i = 0; ast->array_init[i]; i ++) {
+            for(int i = 0; i < ast->size; i ++) {
+                long val = 0;
                 if(i != 0) {
                     printf(",");
                 }
-                printf("%d", ast->array_init[i]->ival);
+                if(i * elemsize < ast->nbytes)
+                    memcpy(&val, ast->blob + i * elemsize, elemsize);
+                printf("%d", elemsize == 1 ? (char)val : (int)val);
             }
             printf("}");
             break;
+        }
+        case AST_FUNC:
+            printf("(%s %s(", ctype_to_string(ast->ctype), ast->func_name);
+            for(int i = 0; i < ast->nparams; i++) {
+                if(i != 0)
+                    printf(",");
+                printf("%s %s", ctype_to_string(ast->params[i]->ctype), ast->params[i]->lname);
+            }
+            printf(") ");
+            print_block(ast->body);
+            printf(")");
+            break;
+        case AST_RETURN:
+            printf("(return ");
+            print_ast(ast->operand);
+            printf(")");
+            break;
         case AST_IF:
-            printf("if");
+            printf("(if ");
+            print_ast(ast->cond);
+            printf(" ");
+            print_block(ast->then);
+            if(ast->els) {
+                printf(" ");
+                print_block(ast->els);
+            }
+            printf(")");
+            break;
+        case AST_WHILE:
+            printf("(while ");
+            print_ast(ast->forcond);
+            printf(" ");
+            print_block(ast->forbody);
+            printf(")");
+            break;
+        case AST_SWITCH:
+            printf("(switch ");
+            print_ast(ast->swcond);
+            printf(" ");
+            print_block(ast->swbody);
+            printf(")");
+            break;
+        case AST_CASE:
+            printf("(case %d)", ast->caseval);
+            break;
+        case AST_DEFAULT:
+            printf("(default)");
+            break;
+        case AST_BREAK:
+            printf("(break)");
+            break;
+        case AST_FOR:
+            printf("(for ");
+            print_opt_ast(ast->forinit);
+            printf(" ");
+            print_opt_ast(ast->forcond);
+            printf(" ");
+            print_opt_ast(ast->forstep);
+            printf(" ");
+            print_block(ast->forbody);
+            printf(")");
             break;
 		default:
 		  printf("should not reach here!");
@@ -756,50 +1321,177 @@ static void print_ast(Ast *ast) {
 	}
 }
 
-int main(int argc, char **arg) {
+// 函数之间互不影响，每个函数的优化和生成是一个任务，汇编按原来的顺序输出
+typedef struct {
+    Ast **funcs;
+    char **asms;
+    bool emit;
+    double *topt;       // 每个函数优化和生成各用了多少秒，-ftime-report用
+    double *temit;
+} Backend;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    Ast *f;
-    Ast *r;
-    Ast *expressions[EXPR_LEN];
-    int nexpr = 0;
-    Token *begin;
+// 各阶段的耗时，多线程的时候是所有线程加起来的
+static void print_time_report(double parse, Backend *be, int nfuncs) {
+    double topt = 0, temit = 0;
+    for(int i = 0; i < nfuncs; i++) {
+        topt += be->topt[i];
+        temit += be->temit[i];
+    }
+    fprintf(stderr, "parse %.6f\noptimize %.6f\ncodegen %.6f\n", parse, topt, temit);
+}
 
-    for(;;) {
-        begin = read_token();
-        if(!begin || is_punct(begin, ';'))
-            break;
+static void backend_task(int i, void *arg) {
+    Backend *be = arg;
+    double t0 = now();
+    optimize(be->funcs[i]);
+    double t1 = now();
+    if(be->emit)
+        be->asms[i] = emit_func(be->funcs[i]);
+    be->topt[i] = t1 - t0;
+    be->temit[i] = now() - t1;
+}
 
-        if(is_type_keyword(begin) || !strcmp(begin->sval, "if")) {
-            printf("%s\n", "is_type_keyword");
+int main(int argc, char **argv) {
+    // -a 只输出Ast，-jit 直接在内存里执行，否则输出汇编。-jN 后端用N个线程。
+    // -fcache-dir=DIR 同样的输入和选项直接用DIR里上次的输出。-flex-chunk=N 输入按N字节一块并行切分
+    bool dump_ast = false;
+    bool jit = false;
+    bool time_report = false;
+    char *use_path = NULL;
+    char *cache_dir = NULL;
+    long cache_max = 64 << 20;
+    bool cache_stats = false;
+    // 会影响输出的选项，按顺序记下来当缓存的键
+    String *opts = make_string();
+    for(int i = 1; i < argc; i++) {
+        if(strncmp(argv[i], "-j", 2) && strncmp(argv[i], "-fcache", 7) && strcmp(argv[i], "-ftime-report") &&
+           strncmp(argv[i], "-flex-chunk=", 12))
+            string_appendf(opts, "%s\n", argv[i]);
+        if(!strcmp(argv[i], "-a"))
+            dump_ast = true;
+        else if(!strcmp(argv[i], "-jit"))
+            jit = true;
+        else if(!strncmp(argv[i], "-j", 2))
+            set_threads(atoi(argv[i] + 2));
+        else if(!strncmp(argv[i], "-I", 2))
+            add_include_path(argv[i] + 2);
+        else if(!strcmp(argv[i], "-ftime-report"))
+            time_report = true;
+        else if(!strcmp(argv[i], "-fprofile-generate"))
+            profile_generate("cc.prof");
+        else if(!strncmp(argv[i], "-fprofile-generate=", 19))
+            profile_generate(argv[i] + 19);
+        else if(!strcmp(argv[i], "-fprofile-use"))
+            use_path = "cc.prof";
+        else if(!strncmp(argv[i], "-fprofile-use=", 14))
+            use_path = argv[i] + 14;
+        else if(!strncmp(argv[i], "-fcache-dir=", 12))
+            cache_dir = argv[i] + 12;
+        else if(!strncmp(argv[i], "-fcache-max=", 12))
+            cache_max = atol(argv[i] + 12);
+        else if(!strcmp(argv[i], "-fcache-stats"))
+            cache_stats = true;
+        else if(!strncmp(argv[i], "-flex-chunk=", 12))
+            set_lex_chunk(atoi(argv[i] + 12));
+        else if(!strncmp(argv[i], "-fcost-", 7) && set_cost(argv[i] + 7))
+            ;
+        else
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+    }
 
-            unget_token(begin);
-            r = read_decl_or_stmt();
-            expressions[nexpr++] = r;
-            break;
-        } else {
-            Ast *left = read_prim();
-            r = make_ast_up(left);
+    if(cache_stats) {
+        if(!cache_dir) {
+            fprintf(stderr, "-fcache-stats needs -fcache-dir\n");
+            return 1;
+        }
+        cache_print_stats(cache_dir);
+        return 0;
+    }
+
+    // -jit直接执行，没有输出可以缓存
+    bool caching = cache_dir && !jit;
+    if(caching) {
+        int len;
+        char *src = read_source(stdin, &len);
+        cache_open(cache_dir, cache_max);
+        cache_key(opts->body, opts->len);
+        if(use_path) {
+            int plen;
+            FILE *fp = fopen(use_path, "r");
+            char *prof = fp ? read_source(fp, &plen) : NULL;
+            cache_key(prof ? prof : "", prof ? plen : 0);
+            if(fp)
+                fclose(fp);
+        }
+        cache_key(src, len);
+        if(cache_lookup())
+            return 0;
+        set_input_file(lex_buffer("-", src, len));
+        cache_capture();
+    }
+
+    // 函数定义单独输出，其余顶层的语句都放进main函数里
+    double start = now();
+    Ast **stmts = read_block();
+    if(peek_token().type != TTYPE_EOF)
+        perror("unexpected '}'");
+
+    if(dump_ast) {
+        for(int v = 0; stmts[v]; v ++) {
+            print_ast(stmts[v]);
         }
-        
-        expressions[nexpr++] = r;
-    }
-
-    for(int v = 0; v < nexpr; v ++) {
-        print_ast(expressions[v]);
-    }
-
-    // 下面是链表的写法
-    // print_ast(f);
-    // if(f->next == NULL) {
-    //     printf("\n%s\n", "next");
-    // } else {
-    //     printf("\n%s\n", "else");
-    // }
-    // while(f) {
-    //     // print_ast(f);
-    //     printf("%s\n", "fff");
-    //     f = f->next ? f->next : NULL;
-    // }
+        if(caching)
+            cache_store();
+        return 0;
+    }
+
+    if(use_path)
+        profile_use(use_path, nif);
+    int n = 0;
+    for(int i = 0; stmts[i]; i++) {
+        if(stmts[i]->type != AST_FUNC)
+            stmts[n++] = stmts[i];
+    }
+    stmts[n] = NULL;
+
+    if(n) {
+        if(find_func("main"))
+            perror("main is defined twice");
+        add_func(make_ast_func(ctype_int, "main", 0, NULL, locals, stmts));
+    }
+
+    int nfuncs = 0;
+    for(Ast *f = funcs; f; f = f->next)
+        nfuncs++;
+    Backend be = {malloc(sizeof(Ast *) * nfuncs), malloc(sizeof(char *) * nfuncs), !jit,
+                  malloc(sizeof(double) * nfuncs), malloc(sizeof(double) * nfuncs)};
+    nfuncs = 0;
+    for(Ast *f = funcs; f; f = f->next)
+        be.funcs[nfuncs++] = f;
+    double parsed = now();
+    run_parallel(nfuncs, backend_task, &be);
+
+    if(jit) {
+        if(time_report)
+            print_time_report(parsed - start, &be, nfuncs);
+        return jit_run(globals, funcs);
+    }
+
+    emit_data_section(globals);
+    for(int i = 0; i < nfuncs; i++)
+        fputs(be.asms[i], stdout);
+    emit_profile_runtime(nif);
+    // 耗时不算诊断，等缓存存完再输出
+    if(caching)
+        cache_store();
+    if(time_report)
+        print_time_report(parsed - start, &be, nfuncs);
 
     return 0;
 }
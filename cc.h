@@ -1,7 +1,12 @@
 #ifndef ECC_H
 #define ECC_H
 
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdarg.h>
+
+// 前6个整数参数用寄存器传递(SysV x86-64)
+#define MAX_ARGS 6
 
 enum {
 	TTYPE_IDENT,
@@ -9,33 +14,261 @@ enum {
 	TTYPE_PUNCT,
 	TTYPE_CHAR,
 	TTYPE_STRING,
+	TTYPE_EOF,
 };
 
+// 两个字符的运算符，单字符的直接用字符本身
+enum {
+	PUNCT_EQ = 128,
+	PUNCT_NE,
+	PUNCT_LE,
+	PUNCT_GE,
+	PUNCT_LOGAND,
+	PUNCT_LOGOR,
+};
+
+// token按值传递，文本不复制，只指向读进来的源码。
+// 字符串是引号里面的原文，转义等用到的时候再由token_string解开
 typedef struct {
 	int type;
+	char *text;
+	int len;
+	bool bol;       // 行首的token，预处理指令用
+	bool noexpand;  // 宏展开时遇到的自身名字，以后也不再展开
 	union {
 		int ival;
-		char *sval;
-		char punct;
+		int punct;
 		char c;
 	};
 } Token;
 
+// 切好token的源文件，头文件只切一次，每次#include都用这一份
+typedef struct {
+	char *path;
+	char *src;      // 原文，编译缓存按它检查头文件有没有改过
+	int len;
+	Token *toks;
+	int ntoks;
+	char *guard;    // 整个文件包在#ifndef guard ... #endif里
+	bool once;      // 出现过#pragma once
+} SrcFile;
+
 typedef struct {
 	char *body;
 	int nalloc;
 	int len;
 } String;
 
+// 二元运算符直接用字符本身表示('+', '=' ...)，所以AST类型从256开始
+enum {
+	AST_LITERAL = 256,
+	AST_STRING,
+	AST_FUNCALL,
+	AST_FUNC,
+	AST_DECL,
+	AST_ADDR,
+	AST_DEREF,
+	AST_LVAR,
+	AST_LREF,
+	AST_GVAR,
+	AST_GREF,
+	AST_ARRAY_INIT,
+	AST_IF,
+	AST_RETURN,
+	AST_WHILE,
+	AST_FOR,
+	AST_SWITCH,
+	AST_CASE,
+	AST_DEFAULT,
+	AST_BREAK,
+};
+
+enum {
+	CTYPE_VOID,
+	CTYPE_INT,
+	CTYPE_CHAR,
+	CTYPE_ARRAY,
+	CTYPE_STR,
+	CTYPE_PTR,
+};
+
+typedef struct Ctype {
+	int type;
+	struct Ctype *ptr;
+	int size;
+} Ctype;
+
+typedef struct Ast Ast;
+struct Ast {
+	int type;
+	Ctype *ctype;
+	Ast *next;
+	union {
+		// Integer
+		int ival;
+		// Char
+		char c;
+		// String
+		struct {
+			char *sval;
+			char *slabel;
+		};
+		// local variable
+		struct {
+			char *lname;
+			int loff;
+			int lver;	// 常量传播里被改写的次数
+			int lreg;	// 提升到的寄存器，从1开始，0是在栈上
+		};
+		// global variable
+		struct {
+			char *gname;
+			char *glabel;
+		};
+		// local reference
+		struct {
+			struct Ast *lref;
+			int lrefoff;
+		};
+		// global reference
+		struct {
+			struct Ast *gref;
+			int goff;
+		};
+		// Binary operator
+		struct {
+			struct Ast *left;
+			struct Ast *right;
+		};
+		// Function call
+		struct {
+			char *fname;
+			int nargs;
+			struct Ast **args;
+		};
+		// Function definition
+		struct {
+			char *func_name;
+			int nparams;
+			struct Ast **params;
+			struct Ast *localvars;
+			struct Ast **body;
+		};
+		// Declaration
+		struct {
+			struct Ast *decl_var;
+			struct Ast *decl_init;
+		};
+		// Array init: 初始值在编译期求值，打包成一段连续的数据(blob)
+		struct {
+			int size;       // 数组元素个数
+			int nbytes;     // blob长度，去掉了末尾的0，剩下的部分补零
+			char *blob;
+			char *blabel;   // blob在.rodata里的标签，全为0时是NULL
+		};
+		// Unary operator
+		struct {
+			struct Ast *operand;
+		};
+		// If statement
+		struct {
+			struct Ast *cond;
+			struct Ast **then;
+			struct Ast **els;
+			int ifid;       // 按出现顺序编号，profile里用它来对应
+		};
+		// Loop: while只有条件和循环体
+		struct {
+			struct Ast *forinit;
+			struct Ast *forcond;    // NULL表示一直循环
+			struct Ast *forstep;
+			struct Ast **forbody;
+			struct Ast **forpre;    // 外提的循环不变量，进循环之前算一次
+			bool forvec;            // opt.c检查过，循环体可以用SIMD指令算
+		};
+		// Switch: case和default是swbody里的语句，标出跳进来的位置
+		struct {
+			struct Ast *swcond;
+			struct Ast **swbody;
+			struct Ast **cases;     // 所有的AST_CASE，按值排好序
+			int ncases;
+			struct Ast *swdefault;  // 没有default的时候是NULL
+		};
+		// Case label
+		struct {
+			int caseval;
+			char *caselabel;        // gen生成的标签
+			int casejit;            // jit的标签编号
+		};
+	};
+};
+
+// switch分派的时候case按段处理：一段是一个值，或者一串够密的值用一张跳转表
+typedef struct {
+	int lo, hi;     // 值的范围
+	int first, n;   // 对应cases[first..first+n-1]
+	bool table;
+} CaseRange;
+
+// 剩下不超过这么多段的时候挨个比较，不再二分
+#define CASE_LINEAR_MAX 3
+
 extern String *make_string(void);
 extern char *get_cstring(String *s);
 extern void string_append(String *s, char c);
 extern void string_appendf(String *s, char *fmt, ...);
+extern void string_vappendf(String *s, char *fmt, va_list args);
+
+extern char *token_to_string(Token tok);
+extern bool is_punct(Token tok, int c);
+extern bool is_ident(Token tok, char *s);
+extern char *token_ident(Token tok);
+extern char *token_string(Token tok);
+extern char *read_source(FILE *fp, int *lenp);
+extern SrcFile *lex_file(char *path);
+extern SrcFile *lex_buffer(char *path, char *buf, int len);
+extern void set_lex_chunk(int n);
+
+extern void add_include_path(char *dir);
+extern void set_input_file(SrcFile *f);
+extern SrcFile **source_files(int *n);
+extern void unget_token(Token tok);
+extern Token peek_token(void);
+extern Token read_token(void);
+
+extern char *make_next_label(void);
+extern int ctype_size(Ctype *ctype);
+extern bool is_compare_op(int op);
+
+extern bool eval_const(Ast *ast, long *val);
+extern int switch_ranges(Ast *sw, CaseRange **ranges);
+extern int layout_frame(Ast *func, bool promote);
+extern void emit_data_section(Ast *globals);
+extern void emit_quote(char *p, int len);
+extern bool set_cost(char *opt);
+extern char *emit_func(Ast *func);
+extern void emitf(char *fmt, ...);
+
+extern int jit_run(Ast *globals, Ast *funcs);
+
+extern void optimize(Ast *func);
+
+extern void set_threads(int n);
+extern void run_parallel(int n, void (*fn)(int task, void *arg), void *arg);
+
+extern void profile_generate(char *path);
+extern bool profile_generating(void);
+extern void profile_use(char *path, int nif);
+extern bool profile_lookup(int id, long *then, long *total);
+extern void emit_profile_counter(int id, int which);
+extern void emit_profile_register(void);
+extern void emit_profile_runtime(int nif);
 
-extern char *token_to_string(Token *token);
-extern bool is_punct(Token *tok, char c);
-extern void unget_token(Token *tok);
-extern Token *peek_token(void);
-extern Token *read_token(void);
+extern void cache_open(char *dir, long max_size);
+extern void cache_key(char *data, int len);
+extern bool cache_lookup(void);
+extern void cache_capture(void);
+extern void cache_store(void);
+extern void cache_print_stats(char *dir);
 
-#endif /* ECC_H */
\ No newline at end of file
+#endif /* ECC_H */
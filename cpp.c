@@ -0,0 +1,755 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cc.h"
+
+// 预处理：在token数组上处理指令和宏展开，语法分析从这里取token
+
+#define MACRO_HASH 1024
+#define MAX_INCLUDE_DEPTH 200
+
+typedef struct Macro {
+	Token name;
+	bool funclike;
+	int nparams;
+	Token *params;
+	Token *body;        // 直接指向#define那一行的token，不复制
+	int nbody;
+	bool disabled;      // 正在展开，里面再出现自己的名字不展开
+	struct Macro *next;
+} Macro;
+
+// 读token的来源：文件、宏展开的结果或者#if/实参要先展开的一串token
+typedef struct {
+	Token *toks;
+	int len;
+	int pos;
+	SrcFile *file;
+	Macro *macro;       // 读完之后才重新允许展开
+	bool barrier;       // 读完了返回EOF，不接着读外层
+	int ncond;          // 进这个文件时#if栈的深度
+} Context;
+
+// #if栈：taken表示这一组#if/#elif/#else里已经有一支成立了
+typedef struct {
+	bool taken;
+	bool in_else;
+} Cond;
+
+static Macro *macros[MACRO_HASH];
+static SrcFile **files;
+static int nfiles;
+static char **include_paths;
+static int npaths;
+
+static Context *ctx;
+static int nctx;
+static int nalloc_ctx;
+static Cond *conds;
+static int ncond;
+static int nalloc_cond;
+
+static Token ungotten;
+static bool has_ungotten = false;
+
+static Token make_eof(void) {
+	Token r = {.type = TTYPE_EOF, .text = ""};
+	return r;
+}
+
+static bool same_text(Token a, Token b) {
+	return a.len == b.len && !memcmp(a.text, b.text, a.len);
+}
+
+static unsigned hash_text(char *p, int len) {
+	unsigned h = 2166136261u;
+	for(int i = 0; i < len; i++)
+		h = (h ^ (unsigned char)p[i]) * 16777619u;
+	return h % MACRO_HASH;
+}
+
+static Macro *find_macro(Token name) {
+	for(Macro *m = macros[hash_text(name.text, name.len)]; m; m = m->next)
+		if(same_text(m->name, name))
+			return m;
+	return NULL;
+}
+
+static void undef_macro(Token name) {
+	Macro **p = &macros[hash_text(name.text, name.len)];
+	for(; *p; p = &(*p)->next) {
+		if(same_text((*p)->name, name)) {
+			*p = (*p)->next;
+			return;
+		}
+	}
+}
+
+static bool is_defined(char *name) {
+	Token tok = {.type = TTYPE_IDENT, .text = name, .len = strlen(name)};
+	return find_macro(tok) != NULL;
+}
+
+void add_include_path(char *dir) {
+	include_paths = realloc(include_paths, sizeof(char *) * (npaths + 1));
+	include_paths[npaths++] = dir;
+}
+
+static void push_context(Token *toks, int len, SrcFile *file, Macro *macro, bool barrier) {
+	if(nctx == nalloc_ctx) {
+		nalloc_ctx = nalloc_ctx ? nalloc_ctx * 2 : 16;
+		ctx = realloc(ctx, sizeof(Context) * nalloc_ctx);
+	}
+	Context c = {toks, len, 0, file, macro, barrier, ncond};
+	ctx[nctx++] = c;
+	if(macro)
+		macro->disabled = true;
+}
+
+static void pop_context(void) {
+	Context *c = &ctx[--nctx];
+	if(c->macro)
+		c->macro->disabled = false;
+	if(c->file && ncond > c->ncond) {
+		perror("unterminated #if");
+		ncond = c->ncond;
+	}
+}
+
+// 不展开宏的下一个token。读完的来源出栈，碰到barrier或者最外层的文件结束返回EOF
+static Token next_raw(void) {
+	for(;;) {
+		Context *c = &ctx[nctx - 1];
+		if(c->pos < c->len)
+			return c->toks[c->pos++];
+		if(c->barrier)
+			return make_eof();
+		if(nctx == 1) {
+			if(ncond) {
+				perror("unterminated #if");
+				ncond = 0;
+			}
+			return make_eof();
+		}
+		pop_context();
+	}
+}
+
+// 退回刚才next_raw读到的token，只能在没读到EOF的时候用
+static void unread_raw(void) {
+	ctx[nctx - 1].pos--;
+}
+
+// 预处理指令到行尾为止，只会出现在文件里
+static Token *read_line(int *len) {
+	Context *c = &ctx[nctx - 1];
+	int start = c->pos;
+	while(c->pos < c->len && !c->toks[c->pos].bol)
+		c->pos++;
+	*len = c->pos - start;
+	return c->toks + start;
+}
+
+static void skip_line(void) {
+	int len;
+	read_line(&len);
+}
+
+static bool is_directive(Token *t, char *name) {
+	return is_punct(t[0], '#') && t[0].bol && is_ident(t[1], name) && !t[1].bol;
+}
+
+/*
+ * include guard: 文件第一行是#ifndef X，对应的#endif后面就结束了，中间没有#else和#elif。
+ * 这样的文件在X有定义的时候再#include什么也不会留下，直接跳过
+ */
+static void find_guard(SrcFile *f) {
+	Token *t = f->toks;
+	int n = f->ntoks - 1;
+	if(n < 3 || !is_directive(t, "ifndef") || t[2].type != TTYPE_IDENT || t[2].bol)
+		return;
+	if(n > 3 && !t[3].bol)
+		return;
+	int depth = 0;
+	for(int i = 0; i + 1 < n; i++) {
+		if(!is_punct(t[i], '#') || !t[i].bol)
+			continue;
+		if(is_directive(t + i, "if") || is_directive(t + i, "ifdef") || is_directive(t + i, "ifndef")) {
+			depth++;
+		} else if(depth == 1 && (is_directive(t + i, "else") || is_directive(t + i, "elif"))) {
+			// X有定义的时候还有别的分支要展开，不是include guard
+			return;
+		} else if(is_directive(t + i, "endif") && --depth == 0) {
+			int j = i + 2;
+			while(j < n && !t[j].bol)
+				j++;
+			if(j == n)
+				f->guard = token_ident(t[2]);
+			return;
+		}
+	}
+}
+
+static SrcFile *find_file(char *path) {
+	for(int i = 0; i < nfiles; i++)
+		if(!strcmp(files[i]->path, path))
+			return files[i];
+	return NULL;
+}
+
+// 同一个路径只打开、切分一次，以后都从缓存里拿
+static SrcFile *load_file(char *path) {
+	SrcFile *f = find_file(path);
+	if(f)
+		return f;
+	f = lex_file(path);
+	if(!f)
+		return NULL;
+	find_guard(f);
+	files = realloc(files, sizeof(SrcFile *) * (nfiles + 1));
+	files[nfiles++] = f;
+	return f;
+}
+
+static char *join_path(char *dir, int dirlen, char *name, int len) {
+	char *r = malloc(dirlen + len + 2);
+	int n = 0;
+	if(dirlen) {
+		memcpy(r, dir, dirlen);
+		n = dirlen;
+		if(r[n - 1] != '/')
+			r[n++] = '/';
+	}
+	memcpy(r + n, name, len);
+	r[n + len] = '\0';
+	return r;
+}
+
+// "x.h"先找当前文件所在的目录，然后和<x.h>一样按-I的顺序找
+static SrcFile *search_include(char *name, int len, bool quoted) {
+	if(name[0] == '/')
+		return load_file(join_path("", 0, name, len));
+	if(quoted) {
+		char *cur = ctx[nctx - 1].file->path;
+		char *slash = strrchr(cur, '/');
+		SrcFile *f = load_file(join_path(cur, slash ? slash - cur : 0, name, len));
+		if(f)
+			return f;
+	}
+	for(int i = 0; i < npaths; i++) {
+		SrcFile *f = load_file(join_path(include_paths[i], strlen(include_paths[i]), name, len));
+		if(f)
+			return f;
+	}
+	return NULL;
+}
+
+static Token *expand_list(Token *toks, int len, int *nresult);
+
+static void do_include(void) {
+	int len;
+	Token *t = read_line(&len);
+	if(len && t[0].type != TTYPE_STRING && !is_punct(t[0], '<'))
+		t = expand_list(t, len, &len);
+	char *name;
+	int namelen;
+	bool quoted;
+	if(len == 1 && t[0].type == TTYPE_STRING) {
+		name = t[0].text;
+		namelen = t[0].len;
+		quoted = true;
+	} else if(len >= 3 && is_punct(t[0], '<') && is_punct(t[len - 1], '>')) {
+		// 尖括号里的文件名被切成了好几个token，直接取它们在源码里的原文
+		name = t[0].text + 1;
+		namelen = t[len - 1].text - name;
+		quoted = false;
+	} else {
+		perror("#include expects \"FILENAME\" or <FILENAME>");
+		return;
+	}
+	SrcFile *f = search_include(name, namelen, quoted);
+	if(!f) {
+		fprintf(stderr, "%.*s: no such file\n", namelen, name);
+		exit(1);
+	}
+	if(f->once || (f->guard && is_defined(f->guard)))
+		return;
+	if(nctx >= MAX_INCLUDE_DEPTH) {
+		perror("#include nested too deeply");
+		return;
+	}
+	push_context(f->toks, f->ntoks - 1, f, NULL, false);
+}
+
+static void do_define(void) {
+	int len;
+	Token *t = read_line(&len);
+	if(len == 0 || t[0].type != TTYPE_IDENT) {
+		perror("macro name expected");
+		return;
+	}
+	Macro *m = calloc(1, sizeof(Macro));
+	m->name = t[0];
+	int i = 1;
+	// 名字后面紧跟着'('才是带参数的宏
+	if(len > 1 && is_punct(t[1], '(') && t[1].text == t[0].text + t[0].len) {
+		m->funclike = true;
+		m->params = t + 2;
+		for(i = 2; i < len && !is_punct(t[i], ')'); i++) {
+			if(t[i].type != TTYPE_IDENT || (i + 1 < len && !is_punct(t[i + 1], ',') && !is_punct(t[i + 1], ')'))) {
+				perror("malformed macro parameter list");
+				return;
+			}
+			m->nparams++;
+			if(is_punct(t[i + 1], ','))
+				i++;
+		}
+		if(i == len) {
+			perror("missing ')' in macro parameter list");
+			return;
+		}
+		i++;
+		// params里隔着','，挪到一起
+		Token *params = malloc(sizeof(Token) * (m->nparams + 1));
+		for(int j = 0, k = 2; j < m->nparams; j++, k += 2)
+			params[j] = t[k];
+		m->params = params;
+	}
+	m->body = t + i;
+	m->nbody = len - i;
+	undef_macro(m->name);
+	unsigned h = hash_text(m->name.text, m->name.len);
+	m->next = macros[h];
+	macros[h] = m;
+}
+
+static void do_undef(void) {
+	int len;
+	Token *t = read_line(&len);
+	if(len == 0 || t[0].type != TTYPE_IDENT) {
+		perror("macro name expected");
+		return;
+	}
+	undef_macro(t[0]);
+}
+
+// #if的表达式，展开过宏，剩下的标识符都是0
+static Token *ep;
+static Token *eend;
+
+static long eval_expr(void);
+
+static long eval_primary(void) {
+	if(ep == eend) {
+		perror("#if: expression expected");
+		return 0;
+	}
+	Token tok = *ep++;
+	if(tok.type == TTYPE_INT)
+		return tok.ival;
+	if(tok.type == TTYPE_CHAR)
+		return tok.c;
+	if(tok.type == TTYPE_IDENT)
+		return 0;
+	if(is_punct(tok, '(')) {
+		long r = eval_expr();
+		if(ep == eend || !is_punct(*ep, ')'))
+			perror("#if: ')' expected");
+		else
+			ep++;
+		return r;
+	}
+	if(is_punct(tok, '!'))
+		return !eval_primary();
+	if(is_punct(tok, '-'))
+		return -eval_primary();
+	if(is_punct(tok, '+'))
+		return eval_primary();
+	perror("#if: unexpected token");
+	return 0;
+}
+
+static int eval_priority(Token tok) {
+	if(tok.type != TTYPE_PUNCT)
+		return -1;
+	switch(tok.punct) {
+		case '*': case '/': case '%': return 6;
+		case '+': case '-': return 5;
+		case '<': case '>': case PUNCT_LE: case PUNCT_GE: return 4;
+		case PUNCT_EQ: case PUNCT_NE: return 3;
+		case PUNCT_LOGAND: return 2;
+		case PUNCT_LOGOR: return 1;
+		default: return -1;
+	}
+}
+
+static long eval_binop(int op, long l, long r) {
+	switch(op) {
+		case '*': return l * r;
+		case '/': case '%':
+			if(r == 0) {
+				perror("#if: division by zero");
+				return 0;
+			}
+			return op == '/' ? l / r : l % r;
+		case '+': return l + r;
+		case '-': return l - r;
+		case '<': return l < r;
+		case '>': return l > r;
+		case PUNCT_LE: return l <= r;
+		case PUNCT_GE: return l >= r;
+		case PUNCT_EQ: return l == r;
+		case PUNCT_NE: return l != r;
+		case PUNCT_LOGAND: return l && r;
+		default: return l || r;
+	}
+}
+
+static long eval_prec(int prec) {
+	long l = eval_primary();
+	for(;;) {
+		if(ep == eend)
+			return l;
+		int prec2 = eval_priority(*ep);
+		if(prec2 < prec)
+			return l;
+		int op = (ep++)->punct;
+		l = eval_binop(op, l, eval_prec(prec2 + 1));
+	}
+}
+
+static long eval_expr(void) {
+	return eval_prec(0);
+}
+
+static Token make_int(int val) {
+	Token r = {.type = TTYPE_INT, .text = val ? "1" : "0", .len = 1};
+	r.ival = val;
+	return r;
+}
+
+// defined要在展开宏之前换掉
+static bool read_if_expr(void) {
+	int len;
+	Token *line = read_line(&len);
+	Token *t = malloc(sizeof(Token) * (len + 1));
+	int n = 0;
+	for(int i = 0; i < len; i++) {
+		if(!is_ident(line[i], "defined")) {
+			t[n++] = line[i];
+			continue;
+		}
+		bool paren = i + 1 < len && is_punct(line[i + 1], '(');
+		int j = paren ? i + 2 : i + 1;
+		if(j >= len || line[j].type != TTYPE_IDENT || (paren && (j + 1 >= len || !is_punct(line[j + 1], ')')))) {
+			perror("malformed defined");
+			return false;
+		}
+		t[n++] = make_int(find_macro(line[j]) != NULL);
+		i = paren ? j + 1 : j;
+	}
+	t = expand_list(t, n, &n);
+	ep = t;
+	eend = t + n;
+	long r = eval_expr();
+	if(ep != eend)
+		perror("#if: garbage at end of expression");
+	return r != 0;
+}
+
+static bool read_ifdef(void) {
+	int len;
+	Token *t = read_line(&len);
+	if(len == 0 || t[0].type != TTYPE_IDENT) {
+		perror("macro name expected");
+		return false;
+	}
+	return find_macro(t[0]) != NULL;
+}
+
+// 跳过不成立的一组，停在同一层的#elif/#else/#endif前面
+static void skip_group(void) {
+	Context *c = &ctx[nctx - 1];
+	int depth = 0;
+	for(; c->pos < c->len; c->pos++) {
+		Token *t = c->toks + c->pos;
+		if(!is_punct(t[0], '#') || !t[0].bol || c->pos + 1 >= c->len)
+			continue;
+		if(is_directive(t, "if") || is_directive(t, "ifdef") || is_directive(t, "ifndef")) {
+			depth++;
+		} else if(is_directive(t, "endif")) {
+			if(depth-- == 0)
+				return;
+		} else if(depth == 0 && (is_directive(t, "elif") || is_directive(t, "else"))) {
+			return;
+		}
+	}
+}
+
+static void push_cond(bool taken) {
+	if(ncond == nalloc_cond) {
+		nalloc_cond = nalloc_cond ? nalloc_cond * 2 : 16;
+		conds = realloc(conds, sizeof(Cond) * nalloc_cond);
+	}
+	Cond c = {taken, false};
+	conds[ncond++] = c;
+	if(!taken)
+		skip_group();
+}
+
+static Cond *current_cond(char *directive) {
+	if(ncond == ctx[nctx - 1].ncond) {
+		fprintf(stderr, "#%s without #if\n", directive);
+		skip_line();
+		return NULL;
+	}
+	return &conds[ncond - 1];
+}
+
+static void do_elif(void) {
+	Cond *c = current_cond("elif");
+	if(!c)
+		return;
+	if(c->in_else)
+		perror("#elif after #else");
+	if(c->taken) {
+		skip_line();
+		skip_group();
+	} else if(read_if_expr()) {
+		c->taken = true;
+	} else {
+		skip_group();
+	}
+}
+
+static void do_else(void) {
+	Cond *c = current_cond("else");
+	if(!c)
+		return;
+	skip_line();
+	if(c->in_else)
+		perror("#else after #else");
+	c->in_else = true;
+	if(c->taken)
+		skip_group();
+	c->taken = true;
+}
+
+static void do_endif(void) {
+	if(!current_cond("endif"))
+		return;
+	skip_line();
+	ncond--;
+}
+
+static void do_pragma(void) {
+	int len;
+	Token *t = read_line(&len);
+	if(len == 1 && is_ident(t[0], "once"))
+		ctx[nctx - 1].file->once = true;
+}
+
+static void do_error(void) {
+	int len;
+	Token *t = read_line(&len);
+	if(len)
+		fprintf(stderr, "#error %.*s\n", (int)(t[len - 1].text + t[len - 1].len - t[0].text), t[0].text);
+	else
+		fprintf(stderr, "#error\n");
+	exit(1);
+}
+
+static void directive(void) {
+	Context *c = &ctx[nctx - 1];
+	if(c->pos == c->len || c->toks[c->pos].bol)
+		return;     // 只有一个'#'的空指令
+	Token tok = c->toks[c->pos++];
+	if(is_ident(tok, "include")) do_include();
+	else if(is_ident(tok, "define")) do_define();
+	else if(is_ident(tok, "undef")) do_undef();
+	else if(is_ident(tok, "if")) push_cond(read_if_expr());
+	else if(is_ident(tok, "ifdef")) push_cond(read_ifdef());
+	else if(is_ident(tok, "ifndef")) push_cond(!read_ifdef());
+	else if(is_ident(tok, "elif")) do_elif();
+	else if(is_ident(tok, "else")) do_else();
+	else if(is_ident(tok, "endif")) do_endif();
+	else if(is_ident(tok, "pragma")) do_pragma();
+	else if(is_ident(tok, "error")) do_error();
+	else {
+		fprintf(stderr, "unknown directive: #%.*s\n", tok.len, tok.text);
+		skip_line();
+	}
+}
+
+// 实参：到匹配的')'为止，按最外层的','分开
+static Token **read_args(Macro *m, int **lens) {
+	int nalloc = 16;
+	Token *buf = malloc(sizeof(Token) * nalloc);
+	int n = 0;
+	int nargs = m->nparams ? m->nparams : 1;
+	int *starts = calloc(nargs + 1, sizeof(int));
+	*lens = calloc(nargs, sizeof(int));
+	int argi = 0;
+	int depth = 0;
+	for(;;) {
+		Token tok = next_raw();
+		if(tok.type == TTYPE_EOF) {
+			perror("unterminated macro argument list");
+			break;
+		}
+		if(depth == 0 && (is_punct(tok, ')') || is_punct(tok, ','))) {
+			if(argi < nargs)
+				(*lens)[argi] = n - starts[argi];
+			argi++;
+			if(argi < nargs)
+				starts[argi] = n;
+			if(is_punct(tok, ')'))
+				break;
+			continue;
+		}
+		if(is_punct(tok, '('))
+			depth++;
+		else if(is_punct(tok, ')'))
+			depth--;
+		if(n == nalloc) {
+			nalloc *= 2;
+			buf = realloc(buf, sizeof(Token) * nalloc);
+		}
+		tok.bol = false;
+		buf[n++] = tok;
+	}
+	if(argi != nargs || (m->nparams == 0 && n != 0))
+		fprintf(stderr, "macro %.*s: wrong number of arguments\n", m->name.len, m->name.text);
+	Token **args = malloc(sizeof(Token *) * nargs);
+	for(int i = 0; i < nargs; i++)
+		args[i] = buf + starts[i];
+	return args;
+}
+
+static Token read_expanded(void);
+
+// 实参先单独展开，再代入宏体
+static void expand_funclike(Macro *m) {
+	int *lens;
+	Token **args = read_args(m, &lens);
+	for(int i = 0; i < m->nparams; i++)
+		args[i] = expand_list(args[i], lens[i], &lens[i]);
+	int nalloc = m->nbody + 8;
+	Token *r = malloc(sizeof(Token) * nalloc);
+	int n = 0;
+	for(int i = 0; i < m->nbody; i++) {
+		Token *src = &m->body[i];
+		int len = 1;
+		if(m->body[i].type == TTYPE_IDENT) {
+			for(int j = 0; j < m->nparams; j++) {
+				if(same_text(m->body[i], m->params[j])) {
+					src = args[j];
+					len = lens[j];
+					break;
+				}
+			}
+		}
+		if(n + len > nalloc) {
+			nalloc = (n + len) * 2;
+			r = realloc(r, sizeof(Token) * nalloc);
+		}
+		memcpy(r + n, src, sizeof(Token) * len);
+		n += len;
+	}
+	push_context(r, n, NULL, m, false);
+}
+
+// 展开一串token，不会读到这一串外面
+static Token *expand_list(Token *toks, int len, int *nresult) {
+	push_context(toks, len, NULL, NULL, true);
+	int nalloc = len + 8;
+	Token *r = malloc(sizeof(Token) * nalloc);
+	int n = 0;
+	for(;;) {
+		Token tok = read_expanded();
+		if(tok.type == TTYPE_EOF)
+			break;
+		if(n == nalloc) {
+			nalloc *= 2;
+			r = realloc(r, sizeof(Token) * nalloc);
+		}
+		r[n++] = tok;
+	}
+	pop_context();
+	*nresult = n;
+	return r;
+}
+
+static Token read_expanded(void) {
+	for(;;) {
+		Token tok = next_raw();
+		if(tok.bol && is_punct(tok, '#') && ctx[nctx - 1].file) {
+			directive();
+			continue;
+		}
+		if(tok.type != TTYPE_IDENT || tok.noexpand)
+			return tok;
+		Macro *m = find_macro(tok);
+		if(!m)
+			return tok;
+		if(m->disabled) {
+			tok.noexpand = true;
+			return tok;
+		}
+		if(!m->funclike) {
+			push_context(m->body, m->nbody, NULL, m, false);
+			continue;
+		}
+		// 后面不是'('的时候只是个普通的标识符
+		Token next = next_raw();
+		if(!is_punct(next, '(')) {
+			if(next.type != TTYPE_EOF)
+				unread_raw();
+			return tok;
+		}
+		expand_funclike(m);
+	}
+}
+
+// 不设的话从标准输入读
+static SrcFile *input_file;
+
+void set_input_file(SrcFile *f) {
+	input_file = f;
+}
+
+// 读过的所有文件，第一个是输入
+SrcFile **source_files(int *n) {
+	*n = nfiles;
+	return files;
+}
+
+static void init_preprocessor(void) {
+	SrcFile *f = input_file ? input_file : lex_file(NULL);
+	files = malloc(sizeof(SrcFile *));
+	files[nfiles++] = f;
+	push_context(f->toks, f->ntoks - 1, f, NULL, false);
+}
+
+void unget_token(Token tok) {
+	if(has_ungotten)
+		perror("push back buffer is all");
+	ungotten = tok;
+	has_ungotten = true;
+}
+
+Token peek_token(void) {
+	Token tok = read_token();
+	unget_token(tok);
+	return tok;
+}
+
+Token read_token(void) {
+	if(has_ungotten) {
+		has_ungotten = false;
+		return ungotten;
+	}
+	if(!nctx)
+		init_preprocessor();
+	return read_expanded();
+}
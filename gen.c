@@ -0,0 +1,1952 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include "cc.h"
+
+static char *REGS[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static char *REGS32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+static char *REGS8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
+
+// 提升到寄存器的局部变量用callee-saved的寄存器，调用函数的时候不用保存
+#define NPROMOTE 5
+static char *PROMOTE_REGS[] = {"rbx", "r12", "r13", "r14", "r15"};
+static char *PROMOTE_REGS32[] = {"ebx", "r12d", "r13d", "r14d", "r15d"};
+static char *PROMOTE_REGS8[] = {"bl", "r12b", "r13b", "r14b", "r15b"};
+
+// 下面这些状态每个线程一份，不同的函数可以同时生成
+// push/pop过的字节数，call之前要保证%rsp按16字节对齐
+static __thread int stackpos = 0;
+// 函数的汇编先写到这里，最后按源码的顺序拼起来
+static __thread String *out;
+static __thread char *cur_name;
+static __thread int labelseq;
+// 这个函数用到的PROMOTE_REGS，按位
+static __thread int used_regs;
+// 最里层的switch结束的地方，break跳到这里
+static __thread char *break_label;
+
+static void emit_expr(Ast *ast);
+static void emit_block(Ast **block);
+
+void emitf(char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    string_vappendf(out, fmt, args);
+    va_end(args);
+}
+
+static void emit(char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    string_append(out, '\t');
+    string_vappendf(out, fmt, args);
+    string_append(out, '\n');
+    va_end(args);
+}
+
+static void emit_label(char *label) {
+    emitf("%s:\n", label);
+}
+
+// 标签按函数分开编号，和别的函数怎么生成、谁先生成都没有关系
+static char *make_label(void) {
+    String *s = make_string();
+    string_appendf(s, ".L%s.%d", cur_name, labelseq++);
+    return get_cstring(s);
+}
+
+static void push(char *reg) {
+    emit("push %%%s", reg);
+    stackpos += 8;
+}
+
+static void pop(char *reg) {
+    emit("pop %%%s", reg);
+    stackpos -= 8;
+}
+
+// 变量所在的位置，在寄存器里的就是按类型宽度的寄存器名
+static char *var_addr(Ast *var) {
+    String *s = make_string();
+    if(var->type == AST_LVAR && var->lreg) {
+        int r = var->lreg - 1;
+        char *name = var->ctype->type == CTYPE_CHAR ? PROMOTE_REGS8[r] :
+                     var->ctype->type == CTYPE_INT ? PROMOTE_REGS32[r] : PROMOTE_REGS[r];
+        string_appendf(s, "%%%s", name);
+    } else
+        string_appendf(s, "%d(%%rbp)", var->loff);
+    return get_cstring(s);
+}
+
+// 数组不取值，退化成首地址
+static void emit_load(Ctype *ctype, char *addr) {
+    switch(ctype->type) {
+        case CTYPE_CHAR:
+            emit("movsbq %s, %%rax", addr);
+            break;
+        case CTYPE_INT:
+            emit("movslq %s, %%rax", addr);
+            break;
+        case CTYPE_ARRAY:
+            emit("lea %s, %%rax", addr);
+            break;
+        default:
+            emit("mov %s, %%rax", addr);
+    }
+}
+
+static void emit_store(Ctype *ctype, char *addr) {
+    switch(ctype->type) {
+        case CTYPE_CHAR:
+            emit("mov %%al, %s", addr);
+            emit("movsbq %%al, %%rax");
+            break;
+        case CTYPE_INT:
+            emit("mov %%eax, %s", addr);
+            emit("movslq %%eax, %%rax");
+            break;
+        default:
+            emit("mov %%rax, %s", addr);
+    }
+}
+
+static bool is_pointer(Ctype *ctype) {
+    return ctype->type == CTYPE_PTR || ctype->type == CTYPE_ARRAY || ctype->type == CTYPE_STR;
+}
+
+static int pointee_size(Ctype *ctype) {
+    return ctype->type == CTYPE_STR ? 1 : ctype_size(ctype->ptr);
+}
+
+/*
+ * 指令选择：地址表达式按模式匹配成x86的内存操作数disp(base,index,scale)，
+ * 而不是一个节点一条指令地把地址先算进寄存器。
+ * 每种匹配方式按下面的代价表算总代价，选最小的，改这张表就能调整选择。
+ */
+static struct {
+    int insn;       // 一条寄存器之间的指令
+    int load;       // 读内存
+    int store;      // 写内存
+    int spill;      // 中间结果push/pop一次
+    int index;      // 内存操作数里多一个index寄存器
+    int rmw;        // 直接在内存上add/sub
+    int call;       // 函数调用、分支之类不细算的
+} cost = {1, 3, 3, 4, 1, 5, 20};
+
+// -fcost-名字=N，改代价表里的一项，名字不对返回false
+bool set_cost(char *opt) {
+    struct { char *name; int *val; } fields[] = {
+        {"insn", &cost.insn}, {"load", &cost.load}, {"store", &cost.store}, {"spill", &cost.spill},
+        {"index", &cost.index}, {"rmw", &cost.rmw}, {"call", &cost.call},
+    };
+    char *eq = strchr(opt, '=');
+    if(!eq)
+        return false;
+    int len = eq - opt;
+    for(int i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++) {
+        if(!strncmp(opt, fields[i].name, len) && fields[i].name[len] == '\0') {
+            *fields[i].val = atoi(eq + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 局部变量的基址是%rbp；没有var的时候base要算到寄存器里
+typedef struct {
+    Ast *var;
+    Ast *base;
+    Ast *index;
+    int scale;
+    long disp;
+    int cost;
+} Addr;
+
+static void tile_addr(Ast *ptr, Addr *a, int *regcost);
+
+// 按通用方式把值算到%rax里的代价，粗略估计
+static int expr_cost(Ast *ast) {
+    Addr a;
+    int rc;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+            return cost.insn;
+        case AST_LVAR:
+            return ast->ctype->type == CTYPE_ARRAY || ast->lreg ? cost.insn : cost.load;
+        case AST_DEREF:
+            tile_addr(ast->operand, &a, &rc);
+            return a.cost + cost.load;
+        case AST_ADDR:
+            tile_addr(ast, &a, &rc);
+            return rc;
+        case '+': case '-': case '*': case '/': case '%':
+        case '<': case '>': case PUNCT_EQ: case PUNCT_NE: case PUNCT_LE: case PUNCT_GE:
+            if(ast->right->type == AST_LITERAL || (ast->right->type == AST_LVAR && ast->right->lreg))
+                return expr_cost(ast->left) + cost.insn;
+            return expr_cost(ast->left) + expr_cost(ast->right) + cost.spill + cost.insn;
+        default:
+            return cost.call;
+    }
+}
+
+static bool fits_disp(long disp) {
+    return disp >= -0x80000000L && disp <= 0x7fffffffL;
+}
+
+/*
+ * ptr是一个地址值。*regcost是一个节点一条指令地算到寄存器里的代价，
+ * a是代价最小的内存操作数。能匹配的模式：
+ *   &x, 数组x          -> x所在的位置
+ *   &*p               -> p
+ *   p + c, p - c      -> disp加上c*元素大小
+ *   p + i             -> index是i，scale是元素大小(1,2,4,8)
+ * 都不如直接算便宜的时候a的base就是ptr本身
+ */
+static void tile_addr(Ast *ptr, Addr *a, int *regcost) {
+    Addr r = {NULL, NULL, NULL, 1, 0, 0};
+    bool matched = false;
+    switch(ptr->type) {
+        case AST_ADDR: {
+            Ast *x = ptr->operand;
+            *regcost = cost.insn;
+            if(x->type == AST_LVAR) {
+                r.var = x;
+                matched = true;
+            } else if(x->type == AST_DEREF) {
+                tile_addr(x->operand, &r, regcost);
+                matched = true;
+            }
+            break;
+        }
+        case AST_LVAR:
+            *regcost = expr_cost(ptr);
+            if(ptr->ctype->type == CTYPE_ARRAY) {
+                r.var = ptr;
+                matched = true;
+            }
+            break;
+        case '+':
+        case '-': {
+            Ast *p = ptr->left;
+            Ast *i = ptr->right;
+            if(ptr->type == '+' && !is_pointer(p->ctype)) {
+                p = ptr->right;
+                i = ptr->left;
+            }
+            if(!is_pointer(p->ctype) || is_pointer(i->ctype)) {
+                *regcost = expr_cost(ptr);
+                break;
+            }
+            int size = pointee_size(p->ctype);
+            int pc, ic = expr_cost(i);
+            tile_addr(p, &r, &pc);
+            // 通用的做法：两边分别算，下标乘元素大小再相加
+            *regcost = pc + ic + cost.spill + cost.insn * (size > 1 ? 3 : 2);
+            long val;
+            if(eval_const(i, &val)) {
+                long disp = r.disp + (ptr->type == '+' ? val : -val) * size;
+                matched = fits_disp(disp);
+                r.disp = disp;
+                break;
+            }
+            if(ptr->type == '-' || r.index)
+                break;
+            if(size != 1 && size != 2 && size != 4 && size != 8)
+                break;
+            r.index = i;
+            r.scale = size;
+            r.cost += ic + cost.index + (r.base ? cost.spill : 0);
+            matched = true;
+            break;
+        }
+        default:
+            *regcost = expr_cost(ptr);
+    }
+    if(!matched || r.cost > *regcost) {
+        Addr reg = {NULL, ptr, NULL, 1, 0, *regcost};
+        r = reg;
+    }
+    *a = r;
+}
+
+static bool match_addr(Ast *ptr, Addr *a) {
+    int rc;
+    tile_addr(ptr, a, &rc);
+    return a->base != ptr;
+}
+
+static void addr_in_reg(Ast *ptr, Addr *a) {
+    Addr r = {NULL, ptr, NULL, 1, 0, 0};
+    *a = r;
+}
+
+// 把base和index算到寄存器breg和ireg里，返回内存操作数
+static char *emit_addr_operand(Addr *a, char *breg, char *ireg) {
+    // 寄存器里的变量只会作为lvalue整个出现，没有偏移和下标
+    if(a->var && a->var->lreg)
+        return var_addr(a->var);
+    String *s = make_string();
+    if(a->var) {
+        if(a->index) {
+            emit_expr(a->index);
+            emit("mov %%rax, %%%s", ireg);
+        }
+        string_appendf(s, "%ld(%%rbp", a->var->loff + a->disp);
+    } else {
+        if(a->index) {
+            emit_expr(a->index);
+            push("rax");
+        }
+        emit_expr(a->base);
+        if(strcmp(breg, "rax"))
+            emit("mov %%rax, %%%s", breg);
+        if(a->index)
+            pop(ireg);
+        if(a->disp)
+            string_appendf(s, "%ld", a->disp);
+        string_appendf(s, "(%%%s", breg);
+    }
+    if(a->index)
+        string_appendf(s, ",%%%s,%d", ireg, a->scale);
+    string_append(s, ')');
+    return get_cstring(s);
+}
+
+// lvalue所在的位置
+static void lvalue_addr(Ast *ast, Addr *a) {
+    switch(ast->type) {
+        case AST_LVAR: {
+            Addr v = {ast, NULL, NULL, 1, 0, 0};
+            *a = v;
+            break;
+        }
+        case AST_DEREF:
+            if(!match_addr(ast->operand, a))
+                addr_in_reg(ast->operand, a);
+            break;
+        default:
+            perror("lvalue expected");
+            exit(1);
+    }
+}
+
+// 地址值，能合成一条lea的时候不一步一步算
+static void emit_lea(Addr *a) {
+    if(a->var || a->index || a->disp) {
+        emit("lea %s, %%rax", emit_addr_operand(a, "rax", "rcx"));
+        return;
+    }
+    emit_expr(a->base);
+}
+
+static void emit_addr(Ast *ast) {
+    Addr a;
+    lvalue_addr(ast, &a);
+    emit_lea(&a);
+}
+
+// 两棵树算出同一个位置或者同一个值，而且没有副作用，可以只算一次
+static bool same_expr(Ast *a, Ast *b) {
+    if(a->type != b->type || a->ctype->type != b->ctype->type)
+        return false;
+    switch(a->type) {
+        case AST_LVAR:
+            return a == b;
+        case AST_LITERAL:
+            return a->ival == b->ival && a->c == b->c;
+        case AST_DEREF:
+        case AST_ADDR:
+            return same_expr(a->operand, b->operand);
+        case '+': case '-': case '*':
+            return same_expr(a->left, b->left) && same_expr(a->right, b->right);
+        default:
+            return false;
+    }
+}
+
+static char *size_suffix(Ctype *ctype) {
+    switch(ctype->type) {
+        case CTYPE_CHAR: return "b";
+        case CTYPE_INT: return "l";
+        default: return "q";
+    }
+}
+
+static char *sized_rax(Ctype *ctype) {
+    switch(ctype->type) {
+        case CTYPE_CHAR: return "al";
+        case CTYPE_INT: return "eax";
+        default: return "rax";
+    }
+}
+
+/*
+ * x = x + e, x = e + x, x = x - e 直接add/sub到内存上，再读回来当表达式的值。
+ * 截断到x的宽度以后和先算再存的结果一样
+ */
+static bool emit_rmw(Ast *var, Ast *val) {
+    if(val->type != '+' && val->type != '-')
+        return false;
+    if(var->ctype->type == CTYPE_ARRAY || var->ctype->type == CTYPE_STR)
+        return false;
+    Ast *e;
+    if(same_expr(val->left, var))
+        e = val->right;
+    else if(val->type == '+' && same_expr(val->right, var))
+        e = val->left;
+    else
+        return false;
+    if(is_pointer(e->ctype))
+        return false;
+    int scale = is_pointer(var->ctype) ? pointee_size(var->ctype) : 1;
+    if(cost.rmw > cost.load + cost.insn + cost.store)
+        return false;
+    Addr a;
+    lvalue_addr(var, &a);
+    char *op = val->type == '+' ? "add" : "sub";
+    char *sfx = size_suffix(var->ctype);
+    long c;
+    char *mem;
+    if(eval_const(e, &c) && fits_disp(c * scale)) {
+        // 和emit_assign一样先截成操作数的宽度，不靠汇编器截断
+        c *= scale;
+        c = var->ctype->type == CTYPE_CHAR ? (char)c : var->ctype->type == CTYPE_INT ? (int)c : c;
+        mem = emit_addr_operand(&a, "rcx", "rdx");
+        emit("%s%s $%ld, %s", op, sfx, c, mem);
+    } else {
+        emit_expr(e);
+        if(scale > 1)
+            emit("imul $%d, %%rax", scale);
+        bool regs = a.base || a.index;
+        if(regs)
+            push("rax");
+        mem = emit_addr_operand(&a, "rcx", "rdx");
+        if(regs)
+            pop("rax");
+        emit("%s%s %%%s, %s", op, sfx, sized_rax(var->ctype), mem);
+    }
+    emit_load(var->ctype, mem);
+    return true;
+}
+
+static void emit_assign(Ast *ast) {
+    Ast *var = ast->left;
+    if(emit_rmw(var, ast->right))
+        return;
+    Addr a;
+    lvalue_addr(var, &a);
+    // 常量直接存进内存，不经过%rax，也不用保存地址之前的值
+    long c;
+    if(eval_const(ast->right, &c) && var->ctype->type != CTYPE_ARRAY) {
+        c = var->ctype->type == CTYPE_CHAR ? (char)c : var->ctype->type == CTYPE_INT ? (int)c : c;
+        if(fits_disp(c)) {
+            emit("mov%s $%ld, %s", size_suffix(var->ctype), c, emit_addr_operand(&a, "rcx", "rdx"));
+            emit("mov $%ld, %%rax", c);
+            return;
+        }
+    }
+    emit_expr(ast->right);
+    if(!a.base && !a.index) {
+        emit_store(var->ctype, emit_addr_operand(&a, "rcx", "rdx"));
+        return;
+    }
+    push("rax");
+    char *mem = emit_addr_operand(&a, "rcx", "rdx");
+    pop("rax");
+    emit_store(var->ctype, mem);
+}
+
+// 从地址ptr处读一个ctype类型的值
+static void emit_deref(Ast *ptr, Ctype *ctype) {
+    Addr a;
+    if(!match_addr(ptr, &a)) {
+        emit_expr(ptr);
+        emit_load(ctype, "(%rax)");
+        return;
+    }
+    emit_load(ctype, emit_addr_operand(&a, "rax", "rcx"));
+}
+
+// 编译期能算出来的条件，算不出来返回false
+bool eval_const(Ast *ast, long *val) {
+    long l, r;
+    switch(ast->type) {
+        case AST_LITERAL:
+            *val = ast->ctype->type == CTYPE_CHAR ? ast->c : ast->ival;
+            return true;
+        case '!':
+            if(!eval_const(ast->operand, &l))
+                return false;
+            *val = !l;
+            return true;
+        case PUNCT_LOGAND:
+        case PUNCT_LOGOR:
+            if(!eval_const(ast->left, &l))
+                return false;
+            if((ast->type == PUNCT_LOGAND) != (l != 0)) {
+                *val = l != 0;
+                return true;
+            }
+            if(!eval_const(ast->right, &r))
+                return false;
+            *val = r != 0;
+            return true;
+        case '+': case '-': case '*': case '/': case '%':
+        case '<': case '>': case PUNCT_EQ: case PUNCT_NE: case PUNCT_LE: case PUNCT_GE:
+            if(!eval_const(ast->left, &l) || !eval_const(ast->right, &r))
+                return false;
+            break;
+        default:
+            return false;
+    }
+    switch(ast->type) {
+        case '+': *val = (int)(l + r); break;
+        case '-': *val = (int)(l - r); break;
+        case '*': *val = (int)(l * r); break;
+        case '/':
+            if(r == 0)
+                return false;
+            *val = (int)(l / r);
+            break;
+        case '%':
+            if(r == 0)
+                return false;
+            *val = (int)(l % r);
+            break;
+        case '<': *val = l < r; break;
+        case '>': *val = l > r; break;
+        case PUNCT_EQ: *val = l == r; break;
+        case PUNCT_NE: *val = l != r; break;
+        case PUNCT_LE: *val = l <= r; break;
+        case PUNCT_GE: *val = l >= r; break;
+    }
+    return true;
+}
+
+static char *compare_cc(int op, bool is_unsigned) {
+    switch(op) {
+        case PUNCT_EQ: return "e";
+        case PUNCT_NE: return "ne";
+        case '<': return is_unsigned ? "b" : "l";
+        case '>': return is_unsigned ? "a" : "g";
+        case PUNCT_LE: return is_unsigned ? "be" : "le";
+        case PUNCT_GE: return is_unsigned ? "ae" : "ge";
+    }
+    perror("invalid comparison");
+    exit(1);
+}
+
+static int negate_compare(int op) {
+    switch(op) {
+        case PUNCT_EQ: return PUNCT_NE;
+        case PUNCT_NE: return PUNCT_EQ;
+        case '<': return PUNCT_GE;
+        case '>': return PUNCT_LE;
+        case PUNCT_LE: return '>';
+        default: return '<';
+    }
+}
+
+static int swap_compare(int op) {
+    switch(op) {
+        case '<': return '>';
+        case '>': return '<';
+        case PUNCT_LE: return PUNCT_GE;
+        case PUNCT_GE: return PUNCT_LE;
+        default: return op;
+    }
+}
+
+// 比较两个操作数，设好标志位，返回实际比较的运算符。
+// 有一边是常量的时候直接用立即数，不占寄存器
+// 寄存器里的变量直接读到reg里，不用先算到%rax再压栈
+static bool emit_reg_operand(Ast *ast, char *reg) {
+    if(ast->type != AST_LVAR || !ast->lreg)
+        return false;
+    switch(ast->ctype->type) {
+        case CTYPE_CHAR:
+            emit("movsbq %s, %%%s", var_addr(ast), reg);
+            break;
+        case CTYPE_INT:
+            emit("movslq %s, %%%s", var_addr(ast), reg);
+            break;
+        default:
+            emit("mov %s, %%%s", var_addr(ast), reg);
+    }
+    return true;
+}
+
+static int emit_compare(Ast *ast) {
+    int op = ast->type;
+    Ast *left = ast->left;
+    Ast *right = ast->right;
+    long val;
+    if(eval_const(left, &val) && !eval_const(right, &val)) {
+        left = ast->right;
+        right = ast->left;
+        op = swap_compare(op);
+    }
+    if(eval_const(right, &val)) {
+        emit_expr(left);
+        if(val == 0)
+            emit("test %%rax, %%rax");
+        else
+            emit("cmp $%ld, %%rax", val);
+        return op;
+    }
+    emit_expr(left);
+    if(!emit_reg_operand(right, "rcx")) {
+        push("rax");
+        emit_expr(right);
+        emit("mov %%rax, %%rcx");
+        pop("rax");
+    }
+    emit("cmp %%rcx, %%rax");
+    return op;
+}
+
+// 条件为jump_if的时候跳到label，否则顺序往下执行。
+// 比较直接生成cmp+jcc，&&和||直接串成跳转，不算出中间的0/1
+static void emit_cond_jump(Ast *cond, bool jump_if, char *label) {
+    long val;
+    if(eval_const(cond, &val)) {
+        if((val != 0) == jump_if)
+            emit("jmp %s", label);
+        return;
+    }
+    if(cond->type == '!') {
+        emit_cond_jump(cond->operand, !jump_if, label);
+        return;
+    }
+    if(cond->type == PUNCT_LOGAND || cond->type == PUNCT_LOGOR) {
+        // &&的左边为假、||的左边为真就能确定结果
+        bool short_value = cond->type == PUNCT_LOGOR;
+        if(short_value == jump_if) {
+            emit_cond_jump(cond->left, jump_if, label);
+            emit_cond_jump(cond->right, jump_if, label);
+        } else {
+            char *skip = make_label();
+            emit_cond_jump(cond->left, short_value, skip);
+            emit_cond_jump(cond->right, jump_if, label);
+            emit_label(skip);
+        }
+        return;
+    }
+    if(is_compare_op(cond->type)) {
+        bool is_unsigned = is_pointer(cond->left->ctype) || is_pointer(cond->right->ctype);
+        int op = emit_compare(cond);
+        if(!jump_if)
+            op = negate_compare(op);
+        emit("j%s %s", compare_cc(op, is_unsigned), label);
+        return;
+    }
+    emit_expr(cond);
+    emit("test %%rax, %%rax");
+    emit("%s %s", jump_if ? "jne" : "je", label);
+}
+
+static int log2_exact(long v) {
+    int k = 0;
+    if(v <= 0 || (v & (v - 1)))
+        return -1;
+    while((1L << k) != v)
+        k++;
+    return k;
+}
+
+// %rax *= c，用移位、lea和加减代替imul
+static void emit_mul_const(long c) {
+    long a = c < 0 ? -c : c;
+    int k;
+    if(a == 0) {
+        emit("xor %%eax, %%eax");
+        return;
+    }
+    if((k = log2_exact(a)) >= 0) {
+        if(k)
+            emit("shl $%d, %%rax", k);
+    } else if(a % 9 == 0 && (k = log2_exact(a / 9)) >= 0) {
+        emit("lea (%%rax,%%rax,8), %%rax");
+        if(k)
+            emit("shl $%d, %%rax", k);
+    } else if(a % 5 == 0 && (k = log2_exact(a / 5)) >= 0) {
+        emit("lea (%%rax,%%rax,4), %%rax");
+        if(k)
+            emit("shl $%d, %%rax", k);
+    } else if(a % 3 == 0 && (k = log2_exact(a / 3)) >= 0) {
+        emit("lea (%%rax,%%rax,2), %%rax");
+        if(k)
+            emit("shl $%d, %%rax", k);
+    } else if((k = log2_exact(a - 1)) >= 0) {
+        emit("mov %%rax, %%rcx");
+        emit("shl $%d, %%rax", k);
+        emit("add %%rcx, %%rax");
+    } else if((k = log2_exact(a + 1)) >= 0) {
+        emit("mov %%rax, %%rcx");
+        emit("shl $%d, %%rax", k);
+        emit("sub %%rcx, %%rax");
+    } else {
+        emit("imul $%ld, %%rax, %%rax", c);
+        return;
+    }
+    if(c < 0)
+        emit("neg %%rax");
+}
+
+// %rax /= d（或者%=），d是非0常量，结果向0取整。
+// 2的幂：负数先加上d-1再算术右移；
+// 其他：乘以magic number m = 2^(31+l)/|d| + 1，右移31+l位，负数再加1。
+// int的值在%rax里是符号扩展过的，|n| < 2^31且m < 2^32，乘积不会溢出64位
+static void emit_div_const(long d, bool mod) {
+    long a = d < 0 ? -d : d;
+    int k = log2_exact(a);
+    if(mod)
+        emit("mov %%rax, %%rsi");
+    if(k == 0) {
+        // 除以1或-1
+    } else if(k > 0) {
+        emit("lea %ld(%%rax), %%rcx", a - 1);
+        emit("test %%rax, %%rax");
+        emit("cmovs %%rcx, %%rax");
+        emit("sar $%d, %%rax", k);
+    } else {
+        int l = 0;
+        while((1L << l) < a)
+            l++;
+        long m = (1L << (31 + l)) / a + 1;
+        emit("mov %%rax, %%rcx");
+        emit("mov $%ld, %%edx", m);
+        emit("imul %%rdx, %%rax");
+        emit("sar $%d, %%rax", 31 + l);
+        emit("shr $63, %%rcx");
+        emit("add %%rcx, %%rax");
+    }
+    if(d < 0)
+        emit("neg %%rax");
+    if(mod) {
+        // n - n/d*d
+        emit("imul $%ld, %%rax, %%rax", d);
+        emit("sub %%rax, %%rsi");
+        emit("mov %%rsi, %%rax");
+    }
+}
+
+// 乘除的一边是常量的时候不用imul/idiv
+static bool emit_strength_reduced(Ast *ast) {
+    long val;
+    if(ast->ctype->type != CTYPE_INT)
+        return false;
+    switch(ast->type) {
+        case '*':
+            if(eval_const(ast->right, &val)) {
+                emit_expr(ast->left);
+            } else if(eval_const(ast->left, &val)) {
+                emit_expr(ast->right);
+            } else {
+                return false;
+            }
+            emit_mul_const(val);
+            break;
+        case '/':
+        case '%':
+            if(!eval_const(ast->right, &val) || val == 0)
+                return false;
+            emit_expr(ast->left);
+            emit_div_const(val, ast->type == '%');
+            break;
+        default:
+            return false;
+    }
+    emit("movslq %%eax, %%rax");
+    return true;
+}
+
+static void emit_binop(Ast *ast) {
+    if(ast->type == '=') {
+        emit_assign(ast);
+        return;
+    }
+    if(emit_strength_reduced(ast))
+        return;
+    if(is_compare_op(ast->type)) {
+        bool is_unsigned = is_pointer(ast->left->ctype) || is_pointer(ast->right->ctype);
+        int op = emit_compare(ast);
+        emit("set%s %%al", compare_cc(op, is_unsigned));
+        emit("movzbq %%al, %%rax");
+        return;
+    }
+    if(ast->type == PUNCT_LOGAND || ast->type == PUNCT_LOGOR || ast->type == '!') {
+        char *no = make_label();
+        char *end = make_label();
+        emit_cond_jump(ast, false, no);
+        emit("mov $1, %%rax");
+        emit("jmp %s", end);
+        emit_label(no);
+        emit("xor %%eax, %%eax");
+        emit_label(end);
+        return;
+    }
+    Addr a;
+    if(is_pointer(ast->ctype) && match_addr(ast, &a)) {
+        emit_lea(&a);
+        return;
+    }
+    emit_expr(ast->left);
+    // 指针加减整数，整数要乘上元素大小
+    if(emit_reg_operand(ast->right, "rcx")) {
+        if(is_pointer(ast->left->ctype) && pointee_size(ast->left->ctype) > 1)
+            emit("imul $%d, %%rcx", pointee_size(ast->left->ctype));
+    } else {
+        push("rax");
+        emit_expr(ast->right);
+        if(is_pointer(ast->left->ctype) && pointee_size(ast->left->ctype) > 1)
+            emit("imul $%d, %%rax", pointee_size(ast->left->ctype));
+        emit("mov %%rax, %%rcx");
+        pop("rax");
+    }
+    if(is_pointer(ast->right->ctype) && pointee_size(ast->right->ctype) > 1)
+        emit("imul $%d, %%rax", pointee_size(ast->right->ctype));
+
+    switch(ast->type) {
+        case '+':
+            emit("add %%rcx, %%rax");
+            break;
+        case '-':
+            emit("sub %%rcx, %%rax");
+            break;
+        case '*':
+            emit("imul %%rcx, %%rax");
+            break;
+        case '/':
+            emit("cqto");
+            emit("idiv %%rcx");
+            break;
+        case '%':
+            emit("cqto");
+            emit("idiv %%rcx");
+            emit("mov %%rdx, %%rax");
+            break;
+        default:
+            perror("invalid operator");
+            exit(1);
+    }
+    if(ast->ctype->type == CTYPE_INT)
+        emit("movslq %%eax, %%rax");
+}
+
+// 前MAX_ARGS个参数放寄存器，其余的从右往左压栈，
+// call的时候%rsp要16字节对齐，所以先算好要补多少
+static void emit_funcall(Ast *ast) {
+    int nstack = ast->nargs > MAX_ARGS ? ast->nargs - MAX_ARGS : 0;
+    int pad = (stackpos + nstack * 8) % 16;
+    if(pad) {
+        emit("sub $%d, %%rsp", pad);
+        stackpos += pad;
+    }
+    for(int i = ast->nargs - 1; i >= MAX_ARGS; i--) {
+        emit_expr(ast->args[i]);
+        push("rax");
+    }
+    int nreg = ast->nargs - nstack;
+    for(int i = 0; i < nreg; i++) {
+        emit_expr(ast->args[i]);
+        push("rax");
+    }
+    for(int i = nreg - 1; i >= 0; i--)
+        pop(REGS[i]);
+
+    emit("mov $0, %%eax");
+    emit("call %s", ast->fname);
+    if(nstack * 8 + pad) {
+        emit("add $%d, %%rsp", nstack * 8 + pad);
+        stackpos -= nstack * 8 + pad;
+    }
+    switch(ast->ctype->type) {
+        case CTYPE_CHAR:
+            emit("movsbq %%al, %%rax");
+            break;
+        case CTYPE_INT:
+            emit("movslq %%eax, %%rax");
+            break;
+    }
+}
+
+// 用过的callee-saved寄存器存在栈帧最上面，-8(%rbp)往下
+static void emit_epilogue(void) {
+    int n = 0;
+    for(int r = 0; r < NPROMOTE; r++) {
+        if(used_regs & 1 << r)
+            emit("mov %d(%%rbp), %%%s", -8 * ++n, PROMOTE_REGS[r]);
+    }
+    emit("leave");
+    emit("ret");
+}
+
+static void emit_return(Ast *ast) {
+    if(ast->operand)
+        emit_expr(ast->operand);
+    emit_epilogue();
+}
+
+// 非零的部分从.rodata整块拷贝，剩下的一次性清零
+static void emit_array_init(Ast *var, Ast *init) {
+    int size = ctype_size(var->ctype);
+    emit("lea %s, %%rdi", var_addr(var));
+    if(init->nbytes) {
+        emit("lea %s(%%rip), %%rsi", init->blabel);
+        emit("mov $%d, %%ecx", init->nbytes);
+        emit("rep movsb");
+    }
+    if(size > init->nbytes) {
+        emit("xor %%eax, %%eax");
+        emit("mov $%d, %%ecx", size - init->nbytes);
+        emit("rep stosb");
+    }
+}
+
+static void emit_decl(Ast *ast) {
+    Ast *var = ast->decl_var;
+    Ast *init = ast->decl_init;
+    if(!init)
+        return;
+    if(init->type == AST_ARRAY_INIT) {
+        emit_array_init(var, init);
+        return;
+    }
+    emit_expr(init);
+    emit_store(var->ctype, var_addr(var));
+}
+
+// 执行比例低于1/COLD_RATIO的分支算冷分支
+#define COLD_RATIO 10
+
+// 冷分支放到.text.unlikely里，执行完再跳回来
+static void emit_cold_block(char *label, Ast **block, char *join) {
+    emitf("\t.pushsection .text.unlikely\n");
+    emit_label(label);
+    emit_block(block);
+    emit("jmp %s", join);
+    emitf("\t.popsection\n");
+}
+
+// 有profile的时候，执行多的分支放在顺序执行的路径上，
+// 按这个选择跳转的方向，冷分支挪出去
+static void emit_if_with_profile(Ast *ast, long then, long total) {
+    long els = total - then;
+    bool then_hot = then >= els;
+    Ast **hot = then_hot ? ast->then : ast->els;
+    Ast **cold = then_hot ? ast->els : ast->then;
+    long cold_count = then_hot ? els : then;
+    char *other = make_label();
+    char *end = make_label();
+
+    emit_cond_jump(ast->cond, !then_hot, cold ? other : end);
+    if(hot)
+        emit_block(hot);
+    if(!cold) {
+        emit_label(end);
+        return;
+    }
+    if(cold_count * COLD_RATIO < total) {
+        emit_label(end);
+        emit_cold_block(other, cold, end);
+        return;
+    }
+    emit("jmp %s", end);
+    emit_label(other);
+    emit_block(cold);
+    emit_label(end);
+}
+
+static void emit_if(Ast *ast) {
+    long then, total;
+    // 条件是常量的时候只留下会执行的那边
+    if(eval_const(ast->cond, &then)) {
+        Ast **live = then ? ast->then : ast->els;
+        if(live)
+            emit_block(live);
+        return;
+    }
+    if(profile_lookup(ast->ifid, &then, &total)) {
+        emit_if_with_profile(ast, then, total);
+        return;
+    }
+
+    char *ne = make_label();
+    if(profile_generating())
+        emit_profile_counter(ast->ifid, 1);
+    emit_cond_jump(ast->cond, false, ne);
+    if(profile_generating())
+        emit_profile_counter(ast->ifid, 0);
+    emit_block(ast->then);
+    if(ast->els) {
+        char *end = make_label();
+        emit("jmp %s", end);
+        emit_label(ne);
+        emit_block(ast->els);
+        emit_label(end);
+    } else {
+        emit_label(ne);
+    }
+}
+
+// SIMD(SSE2)的循环。%rcx是下标，%rdx是上限，数组的首地址放在VEC_BASES里。
+// 循环不变的标量和求和的累加器占%xmm8以后的寄存器，算表达式用%xmm0~%xmm7
+static char *VEC_BASES[] = {"rsi", "rdi", "r8", "r9", "r10"};
+#define VEC_NBASES 5
+#define VEC_NTEMPS 8
+#define VEC_NFIXED 8
+
+typedef struct {
+    int elem;               // CTYPE_INT或CTYPE_CHAR
+    int esize;
+    Ast *bases[VEC_NBASES];
+    bool stored[VEC_NBASES];
+    int nbases;
+    Ast *fixed[VEC_NFIXED]; // 广播过的标量，求和的时候是被加的变量
+    bool is_acc[VEC_NFIXED];
+    int nfixed;
+} VecLoop;
+
+static Ast *vec_base(Ast *elem) {
+    Ast *addr = elem->operand;
+    return addr->left->type == AST_LVAR && is_pointer(addr->left->ctype) ? addr->left : addr->right;
+}
+
+static int vec_find_base(VecLoop *v, Ast *base) {
+    for(int i = 0; i < v->nbases; i++) {
+        if(v->bases[i] == base)
+            return i;
+    }
+    if(v->nbases == VEC_NBASES)
+        return -1;
+    v->bases[v->nbases] = base;
+    v->stored[v->nbases] = false;
+    return v->nbases++;
+}
+
+static bool same_leaf(Ast *a, Ast *b) {
+    long x, y;
+    if(a->type == AST_LITERAL && b->type == AST_LITERAL)
+        return eval_const(a, &x) && eval_const(b, &y) && x == y;
+    return a == b;
+}
+
+static int vec_find_fixed(VecLoop *v, Ast *leaf, bool acc) {
+    for(int i = 0; !acc && i < v->nfixed; i++) {
+        if(!v->is_acc[i] && same_leaf(v->fixed[i], leaf))
+            return i;
+    }
+    if(v->nfixed == VEC_NFIXED)
+        return -1;
+    v->fixed[v->nfixed] = leaf;
+    v->is_acc[v->nfixed] = acc;
+    return v->nfixed++;
+}
+
+// 收集表达式里的数组和标量，返回算这个表达式要用到的临时寄存器个数，
+// 超出寄存器的个数返回-1
+static int vec_collect(VecLoop *v, Ast *ast, int k) {
+    int l, r;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_LVAR:
+            return vec_find_fixed(v, ast, false) < 0 ? -1 : k + 1;
+        case AST_DEREF:
+            return vec_find_base(v, vec_base(ast)) < 0 ? -1 : k + 1;
+        default:
+            l = vec_collect(v, ast->left, k);
+            r = vec_collect(v, ast->right, k + 1);
+            if(l < 0 || r < 0)
+                return -1;
+            // 乘法还要两个寄存器
+            if(ast->type == '*' && r < k + 4)
+                r = k + 4;
+            return l > r ? l : r;
+    }
+}
+
+static int vec_fixed_reg(VecLoop *v, Ast *leaf) {
+    for(int i = 0; i < v->nfixed; i++) {
+        if(!v->is_acc[i] && same_leaf(v->fixed[i], leaf))
+            return 8 + i;
+    }
+    return -1;
+}
+
+static void emit_vec_load(VecLoop *v, Ast *elem, int reg) {
+    int b = vec_find_base(v, vec_base(elem));
+    emit("movdqu (%%%s,%%rcx,%d), %%xmm%d", VEC_BASES[b], v->esize, reg);
+}
+
+// 32位整数的乘法，SSE2只有pmuludq：奇偶两组分开乘再拼回来
+static void emit_vec_mul(int dst, int src) {
+    emit("movdqa %%xmm%d, %%xmm%d", dst, dst + 2);
+    emit("pmuludq %%xmm%d, %%xmm%d", src, dst);
+    emit("psrlq $32, %%xmm%d", dst + 2);
+    emit("movdqa %%xmm%d, %%xmm%d", src, dst + 3);
+    emit("psrlq $32, %%xmm%d", dst + 3);
+    emit("pmuludq %%xmm%d, %%xmm%d", dst + 3, dst + 2);
+    emit("pshufd $8, %%xmm%d, %%xmm%d", dst, dst);
+    emit("pshufd $8, %%xmm%d, %%xmm%d", dst + 2, dst + 2);
+    emit("punpckldq %%xmm%d, %%xmm%d", dst + 2, dst);
+}
+
+// 结果放在%xmm<k>
+static void emit_vec_expr(VecLoop *v, Ast *ast, int k) {
+    int src;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_LVAR:
+            emit("movdqa %%xmm%d, %%xmm%d", vec_fixed_reg(v, ast), k);
+            return;
+        case AST_DEREF:
+            emit_vec_load(v, ast, k);
+            return;
+    }
+    emit_vec_expr(v, ast->left, k);
+    // 右边是标量的时候直接用它的寄存器
+    src = vec_fixed_reg(v, ast->right);
+    if(ast->right->type == AST_DEREF || src < 0) {
+        emit_vec_expr(v, ast->right, k + 1);
+        src = k + 1;
+    }
+    char *suffix = v->elem == CTYPE_CHAR ? "b" : "d";
+    switch(ast->type) {
+        case '+':
+            emit("padd%s %%xmm%d, %%xmm%d", suffix, src, k);
+            break;
+        case '-':
+            emit("psub%s %%xmm%d, %%xmm%d", suffix, src, k);
+            break;
+        case '*':
+            emit_vec_mul(k, src);
+            break;
+    }
+}
+
+// 求和的语句是s = s + e，返回e
+static Ast *vec_reduction_operand(Ast *stmt) {
+    Ast *rhs = stmt->right;
+    return rhs->left == stmt->left ? rhs->right : rhs->left;
+}
+
+// 把标量广播到%xmm<reg>的每个元素
+static void emit_vec_broadcast(VecLoop *v, Ast *leaf, int reg) {
+    emit_expr(leaf);
+    emit("movd %%eax, %%xmm%d", reg);
+    if(v->elem == CTYPE_CHAR) {
+        emit("punpcklbw %%xmm%d, %%xmm%d", reg, reg);
+        emit("punpcklwd %%xmm%d, %%xmm%d", reg, reg);
+    }
+    emit("pshufd $0, %%xmm%d, %%xmm%d", reg, reg);
+}
+
+// 有指针的时候两块内存可能重叠，首地址相同或者整段不重叠才能按向量算，
+// 否则跳到scalar。%rax是剩下的字节数
+static void emit_vec_alias_check(VecLoop *v, char *scalar) {
+    bool need = false;
+    for(int i = 0; i < v->nbases; i++)
+        need |= v->bases[i]->ctype->type == CTYPE_PTR;
+    if(!need)
+        return;
+    emit("mov %%rdx, %%rax");
+    emit("sub %%rcx, %%rax");
+    emit("imul $%d, %%rax, %%rax", v->esize);
+    for(int i = 0; i < v->nbases; i++) {
+        for(int j = i + 1; j < v->nbases; j++) {
+            if(!v->stored[i] && !v->stored[j])
+                continue;
+            if(v->bases[i]->ctype->type != CTYPE_PTR && v->bases[j]->ctype->type != CTYPE_PTR)
+                continue;
+            char *ok = make_label();
+            char *pos = make_label();
+            emit("mov %%%s, %%r11", VEC_BASES[i]);
+            emit("sub %%%s, %%r11", VEC_BASES[j]);
+            emit("je %s", ok);
+            emit("jns %s", pos);
+            emit("neg %%r11");
+            emit_label(pos);
+            emit("cmp %%rax, %%r11");
+            emit("jl %s", scalar);
+            emit_label(ok);
+        }
+    }
+}
+
+// 向量部分做完以后%rcx写回下标，剩下不满一个向量的元素由原来的循环做
+static bool emit_vector_loop(Ast *ast) {
+    VecLoop v = {0};
+    Ast *index = ast->forcond->left;
+    Ast **body = ast->forbody;
+
+    for(int i = 0; body[i]; i++) {
+        Ast *stmt = body[i];
+        if(stmt->left->type == AST_DEREF) {
+            int b = vec_find_base(&v, vec_base(stmt->left));
+            if(b < 0 || vec_collect(&v, stmt->right, 0) < 0 ||
+               vec_collect(&v, stmt->right, 0) > VEC_NTEMPS)
+                return false;
+            v.stored[b] = true;
+            v.elem = stmt->left->ctype->type;
+        } else {
+            if(vec_find_fixed(&v, stmt->left, true) < 0)
+                return false;
+            int n = vec_collect(&v, vec_reduction_operand(stmt), 0);
+            if(n < 0 || n > VEC_NTEMPS)
+                return false;
+        }
+    }
+    if(!v.elem)
+        v.elem = CTYPE_INT;
+    v.esize = v.elem == CTYPE_CHAR ? 1 : 4;
+    int width = 16 / v.esize;
+
+    char *loop = make_label();
+    char *tail = make_label();
+    char *scalar = make_label();
+
+    for(int i = 0; i < v.nfixed; i++) {
+        if(v.is_acc[i])
+            emit("pxor %%xmm%d, %%xmm%d", 8 + i, 8 + i);
+        else
+            emit_vec_broadcast(&v, v.fixed[i], 8 + i);
+    }
+    emit_expr(ast->forcond->right);
+    push("rax");
+    for(int i = 0; i < v.nbases; i++) {
+        emit_expr(v.bases[i]);
+        push("rax");
+    }
+    for(int i = v.nbases - 1; i >= 0; i--)
+        pop(VEC_BASES[i]);
+    pop("rdx");
+    emit("movslq %s, %%rcx", var_addr(index));
+    emit_vec_alias_check(&v, scalar);
+
+    emit_label(loop);
+    emit("lea %d(%%rcx), %%rax", width);
+    emit("cmp %%rdx, %%rax");
+    emit("jg %s", tail);
+    for(int i = 0; body[i]; i++) {
+        Ast *stmt = body[i];
+        if(stmt->left->type == AST_DEREF) {
+            emit_vec_expr(&v, stmt->right, 0);
+            int b = vec_find_base(&v, vec_base(stmt->left));
+            emit("movdqu %%xmm0, (%%%s,%%rcx,%d)", VEC_BASES[b], v.esize);
+        } else {
+            emit_vec_expr(&v, vec_reduction_operand(stmt), 0);
+            for(int j = 0; j < v.nfixed; j++) {
+                if(v.is_acc[j] && v.fixed[j] == stmt->left)
+                    emit("paddd %%xmm0, %%xmm%d", 8 + j);
+            }
+        }
+    }
+    emit("add $%d, %%rcx", width);
+    emit("jmp %s", loop);
+
+    emit_label(tail);
+    emit("mov %%ecx, %s", var_addr(index));
+    // 累加器里的4个数加起来，再加到变量上
+    for(int i = 0; i < v.nfixed; i++) {
+        if(!v.is_acc[i])
+            continue;
+        emit("pshufd $0x4e, %%xmm%d, %%xmm0", 8 + i);
+        emit("paddd %%xmm0, %%xmm%d", 8 + i);
+        emit("pshufd $0xb1, %%xmm%d, %%xmm0", 8 + i);
+        emit("paddd %%xmm0, %%xmm%d", 8 + i);
+        emit("movd %%xmm%d, %%eax", 8 + i);
+        emit("add %%eax, %s", var_addr(v.fixed[i]));
+    }
+    emit_label(scalar);
+    return true;
+}
+
+// 条件放在循环体后面，每次迭代只有一个条件跳转
+static void emit_loop(Ast *ast) {
+    long val;
+    if(ast->forinit)
+        emit_expr(ast->forinit);
+    if(ast->forpre)
+        emit_block(ast->forpre);
+    bool forever = !ast->forcond;
+    if(ast->forcond && eval_const(ast->forcond, &val)) {
+        if(!val)
+            return;
+        forever = true;
+    }
+    if(ast->forvec)
+        emit_vector_loop(ast);
+
+    char *body = make_label();
+    char *cond = make_label();
+    if(!forever)
+        emit("jmp %s", cond);
+    emit_label(body);
+    emit_block(ast->forbody);
+    if(ast->forstep)
+        emit_expr(ast->forstep);
+    if(forever) {
+        emit("jmp %s", body);
+        return;
+    }
+    emit_label(cond);
+    emit_cond_jump(ast->forcond, true, body);
+}
+
+// 跳转表至少要有这么多个case，项里至少要有JUMP_TABLE_DENSITY%是case，
+// 不然比较几次就能找到，不值得多一次间接跳转和表占的空间
+#define JUMP_TABLE_MIN 4
+#define JUMP_TABLE_DENSITY 40
+
+// 排好序的case从前往后贪心地分段：从第i个开始，能放进一张够密的表的最多的case
+// 成为一段，不够JUMP_TABLE_MIN个的话第i个单独一段。jit也用这个
+int switch_ranges(Ast *sw, CaseRange **ranges) {
+    Ast **cases = sw->cases;
+    int n = sw->ncases;
+    CaseRange *r = malloc(sizeof(CaseRange) * (n ? n : 1));
+    int nr = 0;
+    for(int i = 0; i < n; ) {
+        int lo = cases[i]->caseval;
+        int last = i;
+        for(int j = i + 1; j < n; j++) {
+            long span = (long)cases[j]->caseval - lo + 1;
+            // 后面的case全放进来也不够密了
+            if(span * JUMP_TABLE_DENSITY > (long)(n - i) * 100)
+                break;
+            if((long)(j - i + 1) * 100 >= span * JUMP_TABLE_DENSITY)
+                last = j;
+        }
+        if(last - i + 1 < JUMP_TABLE_MIN)
+            last = i;
+        r[nr++] = (CaseRange){lo, cases[last]->caseval, i, last - i + 1, last > i};
+        i = last + 1;
+    }
+    *ranges = r;
+    return nr;
+}
+
+// 值在%eax里，在表的范围里就按表跳，否则跳到next。
+// 表里放case相对表头的偏移，没有case的项跳到def
+static void emit_jump_table(Ast *sw, CaseRange *r, char *next, char *def) {
+    char *table = make_label();
+    emit("mov %%eax, %%ecx");
+    emit("sub $%d, %%ecx", r->lo);
+    emit("cmp $%d, %%ecx", r->hi - r->lo);
+    emit("ja %s", next);
+    emit("lea %s(%%rip), %%rdx", table);
+    emit("movslq (%%rdx,%%rcx,4), %%rcx");
+    emit("add %%rdx, %%rcx");
+    emit("jmp *%%rcx");
+    emitf("\t.pushsection .rodata\n");
+    emitf("\t.align 4\n");
+    emit_label(table);
+    Ast **c = sw->cases + r->first;
+    for(long v = r->lo; v <= r->hi; v++) {
+        char *target = def;
+        if((*c)->caseval == v)
+            target = (*c++)->caselabel;
+        emitf("\t.long %s-%s\n", target, table);
+    }
+    emitf("\t.popsection\n");
+}
+
+// 在ranges[lo..hi]里二分查找%eax，哪段都不是就跳到def
+static void emit_case_tree(Ast *sw, CaseRange *r, int lo, int hi, char *def) {
+    if(hi - lo + 1 <= CASE_LINEAR_MAX) {
+        for(int i = lo; i <= hi; i++) {
+            if(!r[i].table) {
+                emit("cmp $%d, %%eax", r[i].lo);
+                emit("je %s", sw->cases[r[i].first]->caselabel);
+                if(i == hi)
+                    emit("jmp %s", def);
+                continue;
+            }
+            char *next = i == hi ? def : make_label();
+            emit_jump_table(sw, &r[i], next, def);
+            if(i != hi)
+                emit_label(next);
+        }
+        return;
+    }
+    int mid = (lo + hi + 1) / 2;
+    char *left = make_label();
+    emit("cmp $%d, %%eax", r[mid].lo);
+    emit("jl %s", left);
+    emit_case_tree(sw, r, mid, hi, def);
+    emit_label(left);
+    emit_case_tree(sw, r, lo, mid - 1, def);
+}
+
+// 先分派到case的标签，然后按顺序生成switch里的语句，case的地方放标签
+static void emit_switch(Ast *ast) {
+    char *end = make_label();
+    for(int i = 0; i < ast->ncases; i++)
+        ast->cases[i]->caselabel = make_label();
+    if(ast->swdefault)
+        ast->swdefault->caselabel = make_label();
+    char *def = ast->swdefault ? ast->swdefault->caselabel : end;
+    long val;
+    if(eval_const(ast->swcond, &val)) {
+        char *target = def;
+        for(int i = 0; i < ast->ncases; i++) {
+            if(ast->cases[i]->caseval == (int)val)
+                target = ast->cases[i]->caselabel;
+        }
+        emit("jmp %s", target);
+    } else {
+        emit_expr(ast->swcond);
+        CaseRange *r;
+        int n = switch_ranges(ast, &r);
+        if(n)
+            emit_case_tree(ast, r, 0, n - 1, def);
+        else
+            emit("jmp %s", def);
+        free(r);
+    }
+    char *saved = break_label;
+    break_label = end;
+    emit_block(ast->swbody);
+    break_label = saved;
+    emit_label(end);
+}
+
+static void emit_expr(Ast *ast) {
+    switch(ast->type) {
+        case AST_LITERAL:
+            if(ast->ctype->type == CTYPE_CHAR)
+                emit("mov $%d, %%rax", ast->c);
+            else
+                emit("mov $%d, %%rax", ast->ival);
+            break;
+        case AST_STRING:
+            emit("lea %s(%%rip), %%rax", ast->slabel);
+            break;
+        case AST_LVAR:
+            emit_load(ast->ctype, var_addr(ast));
+            break;
+        case AST_ADDR:
+            emit_addr(ast->operand);
+            break;
+        case AST_DEREF:
+            emit_deref(ast->operand, ast->ctype);
+            break;
+        case AST_FUNCALL:
+            emit_funcall(ast);
+            break;
+        case AST_DECL:
+            emit_decl(ast);
+            break;
+        case AST_IF:
+            emit_if(ast);
+            break;
+        case AST_WHILE:
+        case AST_FOR:
+            emit_loop(ast);
+            break;
+        case AST_SWITCH:
+            emit_switch(ast);
+            break;
+        case AST_CASE:
+        case AST_DEFAULT:
+            emit_label(ast->caselabel);
+            break;
+        case AST_BREAK:
+            emit("jmp %s", break_label);
+            break;
+        case AST_RETURN:
+            emit_return(ast);
+            break;
+        default:
+            emit_binop(ast);
+    }
+}
+
+static void emit_block(Ast **block) {
+    for(int i = 0; block[i]; i++)
+        emit_expr(block[i]);
+}
+
+// 汇编里的.string，"和\要转义，不可见的字符写成八进制
+void emit_quote(char *p, int len) {
+    printf("\"");
+    for(int i = 0; i < len; i++) {
+        unsigned char c = p[i];
+        if(c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if(c < 0x20 || c >= 0x7f)
+            printf("\\%03o", c);
+        else
+            printf("%c", c);
+    }
+    printf("\"");
+}
+
+static void emit_blob(Ast *init) {
+    int elemsize = ctype_size(init->ctype->ptr);
+    char *directive = elemsize == 1 ? ".byte" : elemsize == 4 ? ".long" : ".quad";
+    int n = init->nbytes / elemsize;
+    for(int i = 0; i < n; i++) {
+        long val = 0;
+        memcpy(&val, init->blob + i * elemsize, elemsize);
+        if(i % 16 == 0)
+            printf("%s\t%s ", i ? "\n" : "", directive);
+        else
+            printf(",");
+        printf("%ld", elemsize == 4 ? (long)(int)val : elemsize == 1 ? (long)(char)val : val);
+    }
+    printf("\n");
+}
+
+// 从末尾往前比较，互为后缀的字符串排序后会挨在一起
+static int compare_reversed(const void *a, const void *b) {
+    char *s = (*(Ast **)a)->sval;
+    char *t = (*(Ast **)b)->sval;
+    int i = strlen(s), j = strlen(t);
+    while(i > 0 && j > 0) {
+        unsigned char c = s[--i], d = t[--j];
+        if(c != d)
+            return c - d;
+    }
+    return i - j;
+}
+
+static bool is_suffix(char *s, char *t) {
+    int i = strlen(s), j = strlen(t);
+    return i <= j && !strcmp(s, t + j - i);
+}
+
+// 整个编译单元的字符串池只输出一次：是别的字面量后缀的不单独占空间，
+// 标签直接指到长字符串的尾部
+static void emit_string_pool(Ast *globals) {
+    int n = 0;
+    for(Ast *p = globals; p; p = p->next)
+        if(p->type == AST_STRING)
+            n++;
+    if(!n)
+        return;
+
+    Ast **pool = malloc(sizeof(Ast *) * n);
+    n = 0;
+    for(Ast *p = globals; p; p = p->next)
+        if(p->type == AST_STRING)
+            pool[n++] = p;
+    qsort(pool, n, sizeof(Ast *), compare_reversed);
+
+    printf("\t.section .rodata\n");
+    Ast *owner = pool[n - 1];
+    for(int i = n - 1; i >= 0; i--) {
+        Ast *p = pool[i];
+        if(p != owner && is_suffix(p->sval, owner->sval)) {
+            printf("\t.set %s, %s+%d\n", p->slabel, owner->slabel,
+                   (int)(strlen(owner->sval) - strlen(p->sval)));
+            continue;
+        }
+        owner = p;
+        printf("%s:\n", p->slabel);
+        printf("\t.string ");
+        emit_quote(p->sval, strlen(p->sval));
+        printf("\n");
+    }
+    free(pool);
+}
+
+void emit_data_section(Ast *globals) {
+    printf("\t.section .note.GNU-stack,\"\",@progbits\n");
+    emit_string_pool(globals);
+    for(Ast *p = globals; p; p = p->next) {
+        switch(p->type) {
+            case AST_ARRAY_INIT:
+                printf("\t.section .rodata\n");
+                printf("\t.align %d\n", ctype_size(p->ctype->ptr));
+                printf("%s:\n", p->blabel);
+                emit_blob(p);
+                break;
+        }
+    }
+}
+
+// 寄存器传进来的参数存到自己的栈槽或者提升到的寄存器里
+static void emit_save_param(Ast *param, int i) {
+    switch(param->ctype->type) {
+        case CTYPE_CHAR:
+            emit("mov %%%s, %s", REGS8[i], var_addr(param));
+            break;
+        case CTYPE_INT:
+            emit("mov %%%s, %s", REGS32[i], var_addr(param));
+            break;
+        default:
+            emit("mov %%%s, %s", REGS[i], var_addr(param));
+    }
+}
+
+// 栈帧布局：按语句给局部变量算活跃区间，区间不重叠的变量共用栈槽，
+// 再按对齐从大到小排，char可以挨着char放
+typedef struct {
+    Ast *var;
+    int first, last;    // 第一次和最后一次引用所在的语句，-1表示没用到
+    bool pinned;        // 取过地址的变量和数组，整个函数里都要留着
+    int size, align;
+    int off;            // 离栈帧底部的距离
+    int seen;           // 最后一次在哪个循环结束的时候处理过
+    long weight;        // 引用的次数，循环里的按嵌套的层数加权
+} Slot;
+
+static __thread Slot *slots;
+static __thread int lifepos;
+// 按顺序记下引用过的槽，循环结束的时候只用看循环里引用过的
+static __thread Slot **touched;
+static __thread int ntouched, touched_alloc, nloops;
+static __thread int loop_depth;
+
+// 布局之前loff暂时存slots里的下标，栈上传进来的参数不占栈帧
+static Slot *var_slot(Ast *var) {
+    if(var->type != AST_LVAR || var->loff >= 0)
+        return NULL;
+    return &slots[-var->loff - 1];
+}
+
+static void mark_use(Ast *var) {
+    Slot *s = var_slot(var);
+    if(!s)
+        return;
+    if(s->first < 0)
+        s->first = lifepos;
+    s->weight += 1L << 3 * (loop_depth < 6 ? loop_depth : 6);
+    if(s->last == lifepos)
+        return;
+    s->last = lifepos;
+    if(ntouched == touched_alloc) {
+        touched_alloc = touched_alloc ? touched_alloc * 2 : 64;
+        touched = realloc(touched, sizeof(Slot *) * touched_alloc);
+    }
+    touched[ntouched++] = s;
+}
+
+static void mark_block(Ast **block);
+
+// 同一条语句里的引用算在同一个位置，不用管表达式里求值的先后
+static void mark_lifetimes(Ast *ast) {
+    Slot *s;
+    if(!ast)
+        return;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_GVAR:
+        case AST_ARRAY_INIT:
+            return;
+        case AST_LVAR:
+            mark_use(ast);
+            return;
+        case AST_ADDR:
+            if((s = var_slot(ast->operand)))
+                s->pinned = true;
+            mark_lifetimes(ast->operand);
+            return;
+        case AST_DEREF:
+        case AST_RETURN:
+        case '!':
+            mark_lifetimes(ast->operand);
+            return;
+        case AST_FUNCALL:
+            for(int i = 0; i < ast->nargs; i++)
+                mark_lifetimes(ast->args[i]);
+            return;
+        case AST_DECL:
+            mark_lifetimes(ast->decl_init);
+            mark_use(ast->decl_var);
+            return;
+        case AST_IF:
+            mark_lifetimes(ast->cond);
+            mark_block(ast->then);
+            mark_block(ast->els);
+            return;
+        case AST_WHILE:
+        case AST_FOR: {
+            mark_lifetimes(ast->forinit);
+            mark_block(ast->forpre);
+            int start = ++lifepos;
+            int mark = ntouched;
+            loop_depth++;
+            mark_lifetimes(ast->forcond);
+            mark_lifetimes(ast->forstep);
+            mark_block(ast->forbody);
+            loop_depth--;
+            // 循环里用到的变量，值可能留到下一次迭代，活跃区间要盖住整个循环。
+            // 顺便去掉重复的，外层的循环就不用再看一遍同一个槽
+            int loop = ++nloops;
+            int m = mark;
+            for(int i = mark; i < ntouched; i++) {
+                Slot *p = touched[i];
+                if(p->seen == loop)
+                    continue;
+                p->seen = loop;
+                if(p->first > start)
+                    p->first = start;
+                p->last = lifepos;
+                touched[m++] = p;
+            }
+            ntouched = m;
+            return;
+        }
+        case AST_SWITCH:
+            mark_lifetimes(ast->swcond);
+            mark_block(ast->swbody);
+            return;
+        case AST_CASE:
+        case AST_DEFAULT:
+        case AST_BREAK:
+            return;
+        default:
+            mark_lifetimes(ast->left);
+            mark_lifetimes(ast->right);
+    }
+}
+
+static void mark_block(Ast **block) {
+    if(!block)
+        return;
+    for(int i = 0; block[i]; i++) {
+        lifepos++;
+        mark_lifetimes(block[i]);
+    }
+}
+
+static int slot_align(Ctype *ctype) {
+    if(ctype->type != CTYPE_ARRAY)
+        return ctype_size(ctype);
+    // 数组按16字节对齐，向量指令可以直接用
+    if(ctype_size(ctype) >= 16)
+        return 16;
+    return slot_align(ctype->ptr);
+}
+
+static bool slot_used(const Slot *s) {
+    // 没用到的变量不会被访问，不用分配
+    return s->first >= 0 || s->pinned;
+}
+
+// 用到的在前面，再按对齐、大小从大到小，同样的按开始的位置
+static int compare_slot(const void *a, const void *b) {
+    const Slot *x = a;
+    const Slot *y = b;
+    if(slot_used(x) != slot_used(y))
+        return slot_used(y) - slot_used(x);
+    if(x->align != y->align)
+        return y->align - x->align;
+    if(x->size != y->size)
+        return y->size - x->size;
+    return x->first - y->first;
+}
+
+// 取过地址的变量和数组整个函数里都活着
+static int slot_last(Slot *s) {
+    return s->pinned ? INT_MAX : s->last;
+}
+
+// 单元按占着它的槽的last排的小根堆
+static void heap_push(int *heap, int *n, int *last, int unit) {
+    int i = (*n)++;
+    for(; i > 0 && last[heap[(i - 1) / 2]] > last[unit]; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = unit;
+}
+
+static int heap_pop(int *heap, int *n, int *last) {
+    int top = heap[0];
+    int x = heap[--*n];
+    int i = 0;
+    for(;;) {
+        int c = i * 2 + 1;
+        if(c >= *n)
+            break;
+        if(c + 1 < *n && last[heap[c + 1]] < last[heap[c]])
+            c++;
+        if(last[heap[c]] >= last[x])
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = x;
+    return top;
+}
+
+static int compare_weight(const void *a, const void *b) {
+    const Slot *x = *(Slot **)a;
+    const Slot *y = *(Slot **)b;
+    if(x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    return x->first - y->first;
+}
+
+// 一个寄存器上已经分配出去的活跃区间，按first排好，互不重叠
+typedef struct {
+    int *first, *last;
+    int n;
+} Busy;
+
+// 第一个first > last的区间的下标
+static int busy_find(Busy *b, int last) {
+    int lo = 0, hi = b->n;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(b->first[mid] <= last)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 逃逸分析：数组和取过地址的变量可能通过指针读写，也可能被调用的函数改掉，
+// 只能放在内存里；其余的标量变量只能通过名字访问，整个生存期都可以放在寄存器里。
+// 寄存器不够的时候按权重挑，活跃区间不重叠的变量共用一个寄存器。
+// 提升了的槽标成没用到，不再占栈帧，返回用到的寄存器个数
+static int promote_vars(int n) {
+    Slot **cand = malloc(sizeof(Slot *) * (n + 1));
+    int ncand = 0;
+    for(int i = 0; i < n; i++) {
+        Slot *s = &slots[i];
+        int t = s->var->ctype->type;
+        // 入口存、出口恢复寄存器也要两次访存，引用太少的不划算
+        if(!s->pinned && s->first >= 0 && s->weight > 2 &&
+           (t == CTYPE_INT || t == CTYPE_CHAR || t == CTYPE_PTR))
+            cand[ncand++] = s;
+    }
+    qsort(cand, ncand, sizeof(Slot *), compare_weight);
+    Busy busy[NPROMOTE];
+    for(int r = 0; r < NPROMOTE; r++) {
+        busy[r].first = malloc(sizeof(int) * (ncand + 1));
+        busy[r].last = malloc(sizeof(int) * (ncand + 1));
+        busy[r].n = 0;
+    }
+    for(int i = 0; i < ncand; i++) {
+        Slot *s = cand[i];
+        for(int r = 0; r < NPROMOTE; r++) {
+            Busy *b = &busy[r];
+            int p = busy_find(b, s->last);
+            if(p && b->last[p - 1] >= s->first)
+                continue;
+            memmove(b->first + p + 1, b->first + p, sizeof(int) * (b->n - p));
+            memmove(b->last + p + 1, b->last + p, sizeof(int) * (b->n - p));
+            b->first[p] = s->first;
+            b->last[p] = s->last;
+            b->n++;
+            s->var->lreg = r + 1;
+            s->first = s->last = -1;
+            used_regs |= 1 << r;
+            break;
+        }
+    }
+    int nused = 0;
+    for(int r = 0; r < NPROMOTE; r++) {
+        free(busy[r].first);
+        free(busy[r].last);
+        if(used_regs & 1 << r)
+            nused++;
+    }
+    free(cand);
+    return nused;
+}
+
+// 给参数和局部变量分配栈槽，返回栈帧的大小(16字节对齐)。
+// promote的时候没有逃逸的变量尽量放进寄存器，栈帧最上面留出保存寄存器的地方
+int layout_frame(Ast *func, bool promote) {
+    // 栈上传进来的参数在返回地址上面：16(%rbp), 24(%rbp)...
+    for(int i = MAX_ARGS; i < func->nparams; i++)
+        func->params[i]->loff = 16 + (i - MAX_ARGS) * 8;
+
+    int n = 0;
+    for(Ast *v = func->localvars; v; v = v->next) {
+        if(v->loff <= 0)
+            n++;
+    }
+    slots = calloc(n + 1, sizeof(Slot));
+    n = 0;
+    for(Ast *v = func->localvars; v; v = v->next) {
+        if(v->loff > 0)
+            continue;
+        Slot *s = &slots[n];
+        s->var = v;
+        s->first = s->last = -1;
+        s->pinned = v->ctype->type == CTYPE_ARRAY;
+        s->size = ctype_size(v->ctype);
+        s->align = slot_align(v->ctype);
+        v->loff = -++n;
+        v->lreg = 0;
+    }
+    // 寄存器传进来的参数在函数入口就要存
+    lifepos = 0;
+    ntouched = 0;
+    for(int i = 0; i < func->nparams && i < MAX_ARGS; i++)
+        mark_use(func->params[i]);
+    mark_block(func->body);
+    used_regs = 0;
+    int nsaved = promote ? promote_vars(n) : 0;
+
+    // 大小和对齐一样的槽分成一类，每类占一段连续的单元，按对齐从大到小排，
+    // 中间不用填充。类里面按first做线性扫描，活跃区间结束了的单元给后面的槽用
+    qsort(slots, n, sizeof(Slot), compare_slot);
+    int *last = malloc(sizeof(int) * (n + 1));
+    int *heap = malloc(sizeof(int) * (n + 1));
+    int *spare = malloc(sizeof(int) * (n + 1));
+    int frame = 0;
+    for(int i = 0; i < n && slot_used(&slots[i]);) {
+        int size = slots[i].size;
+        int align = slots[i].align;
+        int stride = (size + align - 1) / align * align;
+        int base = (frame + align - 1) / align * align;
+        int units = 0, nheap = 0, nspare = 0;
+        for(; i < n && slot_used(&slots[i]) && slots[i].size == size && slots[i].align == align; i++) {
+            Slot *s = &slots[i];
+            while(nheap && last[heap[0]] < s->first)
+                spare[nspare++] = heap_pop(heap, &nheap, last);
+            int unit = nspare ? spare[--nspare] : units++;
+            last[unit] = slot_last(s);
+            heap_push(heap, &nheap, last, unit);
+            s->off = base + unit * stride;
+        }
+        frame = base + units * stride;
+    }
+    free(last);
+    free(heap);
+    free(spare);
+    frame = (frame + nsaved * 8 + 15) / 16 * 16;
+    for(int i = 0; i < n; i++)
+        slots[i].var->loff = slots[i].off - frame;
+    free(slots);
+    return frame;
+}
+
+// 返回这个函数的汇编，可以在任何线程里调用
+char *emit_func(Ast *func) {
+    out = make_string();
+    cur_name = func->func_name;
+    labelseq = 0;
+    int off = layout_frame(func, true);
+
+    emitf("\t.text\n");
+    emitf("\t.globl %s\n", func->func_name);
+    emit_label(func->func_name);
+    push("rbp");
+    emit("mov %%rsp, %%rbp");
+    if(off)
+        emit("sub $%d, %%rsp", off);
+    int nsaved = 0;
+    for(int r = 0; r < NPROMOTE; r++) {
+        if(used_regs & 1 << r)
+            emit("mov %%%s, %d(%%rbp)", PROMOTE_REGS[r], -8 * ++nsaved);
+    }
+    for(int i = 0; i < func->nparams && i < MAX_ARGS; i++)
+        emit_save_param(func->params[i], i);
+    stackpos = 0;
+    if(profile_generating() && !strcmp(func->func_name, "main"))
+        emit_profile_register();
+    emit_block(func->body);
+    emit_epilogue();
+    return get_cstring(out);
+}
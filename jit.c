@@ -0,0 +1,777 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include "cc.h"
+
+// -jit：不经过汇编器，直接把机器码写进内存执行。
+// 代码和gen.c一样是栈机器的写法，只是输出的是字节而不是文本。
+// 内存布局：[代码 | 数据]，数据紧跟在代码后面的页上，
+// 所以字符串和数组的初始数据都能用%rip相对寻址。
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11 };
+
+static int ARGREGS[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// 条件码，x86里cc ^ 1就是相反的条件
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+};
+
+enum { FIX_LABEL, FIX_DATA };
+
+typedef struct {
+    int pos;        // rel32在代码里的位置
+    int kind;
+    int target;     // label的编号或者数据段里的偏移
+} Fixup;
+
+static String *code;
+static String *data;
+static int stackpos;
+
+static int *labels;
+static int nlabels, labels_alloc;
+
+static Fixup *fixups;
+static int nfixups, fixups_alloc;
+
+// 字符串和数组初始值在数据段里的位置
+static Ast **data_ast;
+static int *data_off;
+static int ndata;
+
+static Ast *jit_funcs;
+static int *func_labels;
+static int break_label;     // 最里层的switch结束的地方
+
+static void jit_expr(Ast *ast);
+static void jit_block(Ast **block);
+
+static void byte(int b) {
+    string_append(code, b);
+}
+
+static void bytes(int n, ...) {
+    va_list args;
+    va_start(args, n);
+    for(int i = 0; i < n; i++)
+        byte(va_arg(args, int));
+    va_end(args);
+}
+
+static void imm32(int v) {
+    for(int i = 0; i < 4; i++)
+        byte((v >> (i * 8)) & 0xff);
+}
+
+static void imm64(long v) {
+    for(int i = 0; i < 8; i++)
+        byte((v >> (i * 8)) & 0xff);
+}
+
+static int new_label(void) {
+    if(nlabels == labels_alloc) {
+        labels_alloc = labels_alloc ? labels_alloc * 2 : 64;
+        labels = realloc(labels, sizeof(int) * labels_alloc);
+    }
+    labels[nlabels] = -1;
+    return nlabels++;
+}
+
+static void bind_label(int label) {
+    labels[label] = code->len;
+}
+
+static void add_fixup(int kind, int target) {
+    if(nfixups == fixups_alloc) {
+        fixups_alloc = fixups_alloc ? fixups_alloc * 2 : 64;
+        fixups = realloc(fixups, sizeof(Fixup) * fixups_alloc);
+    }
+    fixups[nfixups++] = (Fixup){code->len, kind, target};
+    imm32(0);
+}
+
+static void jmp(int label) {
+    byte(0xe9);
+    add_fixup(FIX_LABEL, label);
+}
+
+static void jcc(int cc, int label) {
+    bytes(2, 0x0f, 0x80 + cc);
+    add_fixup(FIX_LABEL, label);
+}
+
+static void push_rax(void) {
+    byte(0x50);
+    stackpos += 8;
+}
+
+static void pop(int reg) {
+    if(reg >= R8)
+        byte(0x41);
+    byte(0x58 + (reg & 7));
+    stackpos -= 8;
+}
+
+static void mov_imm(long v) {
+    // mov $imm32, %rax (符号扩展)
+    bytes(3, 0x48, 0xc7, 0xc0);
+    imm32(v);
+}
+
+static void sub_rsp(int n) {
+    bytes(3, 0x48, 0x81, 0xec);
+    imm32(n);
+    stackpos += n;
+}
+
+static void add_rsp(int n) {
+    bytes(3, 0x48, 0x81, 0xc4);
+    imm32(n);
+    stackpos -= n;
+}
+
+static int data_offset(Ast *ast) {
+    for(int i = 0; i < ndata; i++)
+        if(data_ast[i] == ast)
+            return data_off[i];
+    perror("jit: data not found");
+    exit(1);
+}
+
+// lea target(%rip), reg
+static void lea_data(int reg, int off) {
+    bytes(3, 0x48 | (reg >= R8 ? 4 : 0), 0x8d, 0x05 | ((reg & 7) << 3));
+    add_fixup(FIX_DATA, off);
+}
+
+// ModRM的内存操作数：有var的时候是disp32(%rbp)，否则是(%rax)
+static void modrm_mem(int reg, Ast *var) {
+    if(var) {
+        byte(0x85 | ((reg & 7) << 3));
+        imm32(var->loff);
+    } else {
+        byte(0x00 | ((reg & 7) << 3));
+    }
+}
+
+// var为NULL的时候从(%rax)读
+static void load(Ctype *ctype, Ast *var) {
+    switch(ctype->type) {
+        case CTYPE_CHAR:
+            bytes(3, 0x48, 0x0f, 0xbe);
+            break;
+        case CTYPE_INT:
+            bytes(2, 0x48, 0x63);
+            break;
+        case CTYPE_ARRAY:
+            if(!var)
+                return;
+            bytes(2, 0x48, 0x8d);
+            break;
+        default:
+            bytes(2, 0x48, 0x8b);
+    }
+    modrm_mem(RAX, var);
+}
+
+// var为NULL的时候存到(%rcx)
+static void store(Ctype *ctype, Ast *var) {
+    switch(ctype->type) {
+        case CTYPE_CHAR:
+            byte(0x88);
+            break;
+        case CTYPE_INT:
+            byte(0x89);
+            break;
+        default:
+            bytes(2, 0x48, 0x89);
+    }
+    if(var) {
+        modrm_mem(RAX, var);
+    } else {
+        byte(0x01);
+    }
+    switch(ctype->type) {
+        case CTYPE_CHAR:
+            bytes(4, 0x48, 0x0f, 0xbe, 0xc0);
+            break;
+        case CTYPE_INT:
+            bytes(3, 0x48, 0x63, 0xc0);
+            break;
+    }
+}
+
+static void check_var(Ast *var) {
+    if(var->type != AST_LVAR) {
+        perror("jit: only local variables are supported");
+        exit(1);
+    }
+}
+
+static void jit_addr(Ast *ast) {
+    if(ast->type == AST_DEREF) {
+        jit_expr(ast->operand);
+        return;
+    }
+    check_var(ast);
+    bytes(2, 0x48, 0x8d);
+    modrm_mem(RAX, ast);
+}
+
+static void jit_assign(Ast *ast) {
+    Ast *var = ast->left;
+    jit_expr(ast->right);
+    if(var->type == AST_DEREF) {
+        push_rax();
+        jit_expr(var->operand);
+        bytes(3, 0x48, 0x89, 0xc1);     // mov %rax, %rcx
+        pop(RAX);
+        store(var->ctype, NULL);
+        return;
+    }
+    check_var(var);
+    store(var->ctype, var);
+}
+
+static bool is_pointer(Ctype *ctype) {
+    return ctype->type == CTYPE_PTR || ctype->type == CTYPE_ARRAY || ctype->type == CTYPE_STR;
+}
+
+static int pointee_size(Ctype *ctype) {
+    return ctype->type == CTYPE_STR ? 1 : ctype_size(ctype->ptr);
+}
+
+static int compare_cc(int op, bool is_unsigned) {
+    switch(op) {
+        case PUNCT_EQ: return CC_E;
+        case PUNCT_NE: return CC_NE;
+        case '<': return is_unsigned ? CC_B : CC_L;
+        case '>': return is_unsigned ? CC_A : CC_G;
+        case PUNCT_LE: return is_unsigned ? CC_BE : CC_LE;
+        default: return is_unsigned ? CC_AE : CC_GE;
+    }
+}
+
+static int swap_compare(int op) {
+    switch(op) {
+        case '<': return '>';
+        case '>': return '<';
+        case PUNCT_LE: return PUNCT_GE;
+        case PUNCT_GE: return PUNCT_LE;
+        default: return op;
+    }
+}
+
+// 比较完返回条件成立时的条件码
+static int jit_compare(Ast *ast) {
+    bool is_unsigned = is_pointer(ast->left->ctype) || is_pointer(ast->right->ctype);
+    int op = ast->type;
+    Ast *left = ast->left;
+    Ast *right = ast->right;
+    long val;
+    if(eval_const(left, &val) && !eval_const(right, &val)) {
+        left = ast->right;
+        right = ast->left;
+        op = swap_compare(op);
+    }
+    if(eval_const(right, &val)) {
+        jit_expr(left);
+        if(val == 0) {
+            bytes(3, 0x48, 0x85, 0xc0);     // test %rax, %rax
+        } else {
+            bytes(2, 0x48, 0x3d);           // cmp $imm32, %rax
+            imm32(val);
+        }
+        return compare_cc(op, is_unsigned);
+    }
+    jit_expr(left);
+    push_rax();
+    jit_expr(right);
+    bytes(3, 0x48, 0x89, 0xc1);
+    pop(RAX);
+    bytes(3, 0x48, 0x39, 0xc8);             // cmp %rcx, %rax
+    return compare_cc(op, is_unsigned);
+}
+
+static void jit_cond_jump(Ast *cond, bool jump_if, int label) {
+    long val;
+    if(eval_const(cond, &val)) {
+        if((val != 0) == jump_if)
+            jmp(label);
+        return;
+    }
+    if(cond->type == '!') {
+        jit_cond_jump(cond->operand, !jump_if, label);
+        return;
+    }
+    if(cond->type == PUNCT_LOGAND || cond->type == PUNCT_LOGOR) {
+        bool short_value = cond->type == PUNCT_LOGOR;
+        if(short_value == jump_if) {
+            jit_cond_jump(cond->left, jump_if, label);
+            jit_cond_jump(cond->right, jump_if, label);
+        } else {
+            int skip = new_label();
+            jit_cond_jump(cond->left, short_value, skip);
+            jit_cond_jump(cond->right, jump_if, label);
+            bind_label(skip);
+        }
+        return;
+    }
+    if(is_compare_op(cond->type)) {
+        int cc = jit_compare(cond);
+        jcc(jump_if ? cc : cc ^ 1, label);
+        return;
+    }
+    jit_expr(cond);
+    bytes(3, 0x48, 0x85, 0xc0);
+    jcc(jump_if ? CC_NE : CC_E, label);
+}
+
+static void jit_binop(Ast *ast) {
+    if(ast->type == '=') {
+        jit_assign(ast);
+        return;
+    }
+    if(is_compare_op(ast->type)) {
+        int cc = jit_compare(ast);
+        bytes(3, 0x0f, 0x90 + cc, 0xc0);        // setcc %al
+        bytes(4, 0x48, 0x0f, 0xb6, 0xc0);       // movzbq %al, %rax
+        return;
+    }
+    if(ast->type == PUNCT_LOGAND || ast->type == PUNCT_LOGOR || ast->type == '!') {
+        int no = new_label();
+        int end = new_label();
+        jit_cond_jump(ast, false, no);
+        mov_imm(1);
+        jmp(end);
+        bind_label(no);
+        bytes(2, 0x31, 0xc0);
+        bind_label(end);
+        return;
+    }
+    jit_expr(ast->left);
+    push_rax();
+    jit_expr(ast->right);
+    if(is_pointer(ast->left->ctype) && pointee_size(ast->left->ctype) > 1) {
+        bytes(3, 0x48, 0x69, 0xc0);             // imul $imm32, %rax, %rax
+        imm32(pointee_size(ast->left->ctype));
+    }
+    bytes(3, 0x48, 0x89, 0xc1);
+    pop(RAX);
+    if(is_pointer(ast->right->ctype) && pointee_size(ast->right->ctype) > 1) {
+        bytes(3, 0x48, 0x69, 0xc0);
+        imm32(pointee_size(ast->right->ctype));
+    }
+    switch(ast->type) {
+        case '+':
+            bytes(3, 0x48, 0x01, 0xc8);
+            break;
+        case '-':
+            bytes(3, 0x48, 0x29, 0xc8);
+            break;
+        case '*':
+            bytes(4, 0x48, 0x0f, 0xaf, 0xc1);
+            break;
+        case '/':
+            bytes(2, 0x48, 0x99);               // cqto
+            bytes(3, 0x48, 0xf7, 0xf9);         // idiv %rcx
+            break;
+        case '%':
+            bytes(2, 0x48, 0x99);
+            bytes(3, 0x48, 0xf7, 0xf9);
+            bytes(3, 0x48, 0x89, 0xd0);         // mov %rdx, %rax
+            break;
+        default:
+            perror("jit: invalid operator");
+            exit(1);
+    }
+    if(ast->ctype->type == CTYPE_INT)
+        bytes(3, 0x48, 0x63, 0xc0);
+}
+
+static int find_func_label(char *name) {
+    int i = 0;
+    for(Ast *f = jit_funcs; f; f = f->next, i++)
+        if(!strcmp(f->func_name, name))
+            return func_labels[i];
+    return -1;
+}
+
+// 本文件里的函数直接call rel32，其余的用dlsym在libc里找
+static void jit_funcall(Ast *ast) {
+    int nstack = ast->nargs > MAX_ARGS ? ast->nargs - MAX_ARGS : 0;
+    int pad = (stackpos + nstack * 8) % 16;
+    if(pad)
+        sub_rsp(pad);
+    for(int i = ast->nargs - 1; i >= MAX_ARGS; i--) {
+        jit_expr(ast->args[i]);
+        push_rax();
+    }
+    int nreg = ast->nargs - nstack;
+    for(int i = 0; i < nreg; i++) {
+        jit_expr(ast->args[i]);
+        push_rax();
+    }
+    for(int i = nreg - 1; i >= 0; i--)
+        pop(ARGREGS[i]);
+
+    bytes(2, 0x31, 0xc0);
+    int label = find_func_label(ast->fname);
+    if(label >= 0) {
+        byte(0xe8);
+        add_fixup(FIX_LABEL, label);
+    } else {
+        void *addr = dlsym(RTLD_DEFAULT, ast->fname);
+        if(!addr) {
+            fprintf(stderr, "jit: undefined function: %s\n", ast->fname);
+            exit(1);
+        }
+        bytes(2, 0x49, 0xbb);                   // movabs $addr, %r11
+        imm64((long)addr);
+        bytes(3, 0x41, 0xff, 0xd3);             // call *%r11
+    }
+    if(nstack * 8 + pad)
+        add_rsp(nstack * 8 + pad);
+    switch(ast->ctype->type) {
+        case CTYPE_CHAR:
+            bytes(4, 0x48, 0x0f, 0xbe, 0xc0);
+            break;
+        case CTYPE_INT:
+            bytes(3, 0x48, 0x63, 0xc0);
+            break;
+    }
+}
+
+static void jit_decl(Ast *ast) {
+    Ast *var = ast->decl_var;
+    Ast *init = ast->decl_init;
+    if(!init)
+        return;
+    if(init->type != AST_ARRAY_INIT) {
+        jit_expr(init);
+        store(var->ctype, var);
+        return;
+    }
+    int size = ctype_size(var->ctype);
+    bytes(2, 0x48, 0x8d);                       // lea var, %rdi
+    modrm_mem(RDI, var);
+    if(init->nbytes) {
+        lea_data(RSI, data_offset(init));
+        byte(0xb9);                             // mov $n, %ecx
+        imm32(init->nbytes);
+        bytes(2, 0xf3, 0xa4);                   // rep movsb
+    }
+    if(size > init->nbytes) {
+        bytes(2, 0x31, 0xc0);
+        byte(0xb9);
+        imm32(size - init->nbytes);
+        bytes(2, 0xf3, 0xaa);                   // rep stosb
+    }
+}
+
+static void jit_if(Ast *ast) {
+    long val;
+    if(eval_const(ast->cond, &val)) {
+        Ast **live = val ? ast->then : ast->els;
+        if(live)
+            jit_block(live);
+        return;
+    }
+    int ne = new_label();
+    jit_cond_jump(ast->cond, false, ne);
+    jit_block(ast->then);
+    if(ast->els) {
+        int end = new_label();
+        jmp(end);
+        bind_label(ne);
+        jit_block(ast->els);
+        bind_label(end);
+    } else {
+        bind_label(ne);
+    }
+}
+
+static void jit_loop(Ast *ast) {
+    long val;
+    if(ast->forinit)
+        jit_expr(ast->forinit);
+    if(ast->forpre)
+        jit_block(ast->forpre);
+    bool forever = !ast->forcond;
+    if(ast->forcond && eval_const(ast->forcond, &val)) {
+        if(!val)
+            return;
+        forever = true;
+    }
+
+    int body = new_label();
+    int cond = new_label();
+    if(!forever)
+        jmp(cond);
+    bind_label(body);
+    jit_block(ast->forbody);
+    if(ast->forstep)
+        jit_expr(ast->forstep);
+    if(forever) {
+        jmp(body);
+        return;
+    }
+    bind_label(cond);
+    jit_cond_jump(ast->forcond, true, body);
+}
+
+// 值在%eax里。跳转表放在代码里，每项是一条5字节的jmp rel32，
+// 这样表项的位置和别的跳转一样靠FIX_LABEL填
+static void jit_jump_table(Ast *sw, CaseRange *r, int next, int def) {
+    int table = new_label();
+    bytes(2, 0x89, 0xc1);                       // mov %eax, %ecx
+    bytes(2, 0x81, 0xe9);                       // sub $lo, %ecx
+    imm32(r->lo);
+    bytes(2, 0x81, 0xf9);                       // cmp $hi-lo, %ecx
+    imm32(r->hi - r->lo);
+    jcc(CC_A, next);
+    bytes(4, 0x48, 0x8d, 0x0c, 0x89);           // lea (%rcx,%rcx,4), %rcx
+    bytes(3, 0x48, 0x8d, 0x15);                 // lea table(%rip), %rdx
+    add_fixup(FIX_LABEL, table);
+    bytes(3, 0x48, 0x01, 0xd1);                 // add %rdx, %rcx
+    bytes(2, 0xff, 0xe1);                       // jmp *%rcx
+    bind_label(table);
+    Ast **c = sw->cases + r->first;
+    for(long v = r->lo; v <= r->hi; v++) {
+        int target = def;
+        if((*c)->caseval == v)
+            target = (*c++)->casejit;
+        jmp(target);
+    }
+}
+
+// 和gen.c一样：剩下的段不多的时候挨个比较，否则二分
+static void jit_case_tree(Ast *sw, CaseRange *r, int lo, int hi, int def) {
+    if(hi - lo + 1 <= CASE_LINEAR_MAX) {
+        for(int i = lo; i <= hi; i++) {
+            if(!r[i].table) {
+                byte(0x3d);                     // cmp $imm32, %eax
+                imm32(r[i].lo);
+                jcc(CC_E, sw->cases[r[i].first]->casejit);
+                if(i == hi)
+                    jmp(def);
+                continue;
+            }
+            int next = i == hi ? def : new_label();
+            jit_jump_table(sw, &r[i], next, def);
+            if(i != hi)
+                bind_label(next);
+        }
+        return;
+    }
+    int mid = (lo + hi + 1) / 2;
+    int left = new_label();
+    byte(0x3d);
+    imm32(r[mid].lo);
+    jcc(CC_L, left);
+    jit_case_tree(sw, r, mid, hi, def);
+    bind_label(left);
+    jit_case_tree(sw, r, lo, mid - 1, def);
+}
+
+static void jit_switch(Ast *ast) {
+    int end = new_label();
+    for(int i = 0; i < ast->ncases; i++)
+        ast->cases[i]->casejit = new_label();
+    if(ast->swdefault)
+        ast->swdefault->casejit = new_label();
+    int def = ast->swdefault ? ast->swdefault->casejit : end;
+    long val;
+    if(eval_const(ast->swcond, &val)) {
+        int target = def;
+        for(int i = 0; i < ast->ncases; i++) {
+            if(ast->cases[i]->caseval == (int)val)
+                target = ast->cases[i]->casejit;
+        }
+        jmp(target);
+    } else {
+        jit_expr(ast->swcond);
+        CaseRange *r;
+        int n = switch_ranges(ast, &r);
+        if(n)
+            jit_case_tree(ast, r, 0, n - 1, def);
+        else
+            jmp(def);
+        free(r);
+    }
+    int saved = break_label;
+    break_label = end;
+    jit_block(ast->swbody);
+    break_label = saved;
+    bind_label(end);
+}
+
+static void jit_expr(Ast *ast) {
+    switch(ast->type) {
+        case AST_LITERAL:
+            mov_imm(ast->ctype->type == CTYPE_CHAR ? ast->c : ast->ival);
+            break;
+        case AST_STRING:
+            lea_data(RAX, data_offset(ast));
+            break;
+        case AST_LVAR:
+            check_var(ast);
+            load(ast->ctype, ast);
+            break;
+        case AST_ADDR:
+            jit_addr(ast->operand);
+            break;
+        case AST_DEREF:
+            jit_expr(ast->operand);
+            load(ast->ctype, NULL);
+            break;
+        case AST_FUNCALL:
+            jit_funcall(ast);
+            break;
+        case AST_DECL:
+            jit_decl(ast);
+            break;
+        case AST_IF:
+            jit_if(ast);
+            break;
+        case AST_WHILE:
+        case AST_FOR:
+            jit_loop(ast);
+            break;
+        case AST_SWITCH:
+            jit_switch(ast);
+            break;
+        case AST_CASE:
+        case AST_DEFAULT:
+            bind_label(ast->casejit);
+            break;
+        case AST_BREAK:
+            jmp(break_label);
+            break;
+        case AST_RETURN:
+            if(ast->operand)
+                jit_expr(ast->operand);
+            bytes(2, 0xc9, 0xc3);               // leave; ret
+            break;
+        case AST_GVAR:
+            check_var(ast);
+            break;
+        default:
+            jit_binop(ast);
+    }
+}
+
+static void jit_block(Ast **block) {
+    for(int i = 0; block[i]; i++)
+        jit_expr(block[i]);
+}
+
+static void save_param(Ast *param, int i) {
+    int reg = ARGREGS[i];
+    int rex = (reg >= R8 ? 4 : 0);
+    switch(param->ctype->type) {
+        case CTYPE_CHAR:
+            // %sil/%dil要有REX前缀才能编码
+            byte(0x40 | rex);
+            byte(0x88);
+            break;
+        case CTYPE_INT:
+            if(rex)
+                byte(0x40 | rex);
+            byte(0x89);
+            break;
+        default:
+            byte(0x48 | rex);
+            byte(0x89);
+    }
+    modrm_mem(reg, param);
+}
+
+static void jit_func(Ast *func, int label) {
+    int off = layout_frame(func, false);
+    bind_label(label);
+    byte(0x55);                                 // push %rbp
+    bytes(3, 0x48, 0x89, 0xe5);                 // mov %rsp, %rbp
+    stackpos = 0;
+    if(off)
+        sub_rsp(off);
+    for(int i = 0; i < func->nparams && i < MAX_ARGS; i++)
+        save_param(func->params[i], i);
+    stackpos = 0;
+    jit_block(func->body);
+    bytes(2, 0xc9, 0xc3);
+}
+
+static void add_data(Ast *ast, char *p, int len, int align) {
+    while(data->len % align)
+        string_append(data, 0);
+    data_ast = realloc(data_ast, sizeof(Ast *) * (ndata + 1));
+    data_off = realloc(data_off, sizeof(int) * (ndata + 1));
+    data_ast[ndata] = ast;
+    data_off[ndata] = data->len;
+    ndata++;
+    for(int i = 0; i < len; i++)
+        string_append(data, p[i]);
+}
+
+int jit_run(Ast *globals, Ast *funcs) {
+    code = make_string();
+    data = make_string();
+
+    for(Ast *p = globals; p; p = p->next) {
+        if(p->type == AST_STRING)
+            add_data(p, p->sval, strlen(p->sval) + 1, 1);
+        else if(p->type == AST_ARRAY_INIT)
+            add_data(p, p->blob, p->nbytes, 8);
+    }
+
+    int nfuncs = 0;
+    for(Ast *f = funcs; f; f = f->next)
+        nfuncs++;
+    jit_funcs = funcs;
+    func_labels = malloc(sizeof(int) * (nfuncs + 1));
+    for(int i = 0; i < nfuncs; i++)
+        func_labels[i] = new_label();
+    int i = 0;
+    for(Ast *f = funcs; f; f = f->next, i++)
+        jit_func(f, func_labels[i]);
+
+    int main_label = find_func_label("main");
+    if(main_label < 0) {
+        fprintf(stderr, "jit: main is not defined\n");
+        exit(1);
+    }
+
+    // 代码占整数个页，数据从下一页开始，rel32都能算出来
+    long pagesize = sysconf(_SC_PAGESIZE);
+    long code_size = (code->len + pagesize - 1) / pagesize * pagesize;
+    long data_size = (data->len + pagesize - 1) / pagesize * pagesize;
+    char *mem = mmap(NULL, code_size + (data_size ? data_size : pagesize),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memcpy(mem, code->body, code->len);
+    memcpy(mem + code_size, data->body, data->len);
+    for(int i = 0; i < nfixups; i++) {
+        Fixup *f = &fixups[i];
+        long target = f->kind == FIX_LABEL ? labels[f->target] : code_size + f->target;
+        int rel = target - (f->pos + 4);
+        memcpy(mem + f->pos, &rel, 4);
+    }
+    // 代码页只读可执行，数据页可写不可执行
+    if(mprotect(mem, code_size, PROT_READ | PROT_EXEC)) {
+        perror("mprotect");
+        exit(1);
+    }
+
+    int (*entry)(void) = (int (*)(void))(mem + labels[main_label]);
+    return entry();
+}
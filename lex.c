@@ -1,129 +1,179 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include "cc.h"
 
 #define BUFLEN 256
 
-static Token *ungotten = NULL;
+// 正在切分的文件，整个读进来，token只记录在这里的位置。并行切分的时候每个线程一份
+static __thread char *src;
+static __thread int srclen;
+static __thread int pos;
+static __thread bool bol;
+// 猜测着切的块出错不报，只记下来，合并的时候从对的位置重新切一遍
+static __thread bool quiet;
+static __thread bool failed;
 
-static Token *make_ident(String *s) {
-	Token *r = malloc(sizeof(Token));
-	r->type = TTYPE_IDENT;
-	r->sval = get_cstring(s);
-	return r;
+// 比这个大的文件按块并行切分，0是不并行
+static int lex_chunk = 1 << 20;
+
+void set_lex_chunk(int n) {
+	lex_chunk = n;
 }
 
-static Token *make_strtok(String *s) {
-	Token *r  = malloc(sizeof(Token));
-	r->type = TTYPE_STRING;
-	r->sval = get_cstring(s);
-	return r;
+// 整个文件读到内存里，末尾补一个'\0'
+char *read_source(FILE *fp, int *lenp) {
+	int nalloc = BUFLEN;
+	int len = 0;
+	char *buf = malloc(nalloc);
+	for(;;) {
+		len += fread(buf + len, 1, nalloc - len - 1, fp);
+		if(len < nalloc - 1)
+			break;
+		nalloc *= 2;
+		buf = realloc(buf, nalloc);
+	}
+	buf[len] = '\0';
+	*lenp = len;
+	return buf;
 }
 
-static Token *make_punct(char punct) {
-	Token *r = malloc(sizeof(Token));
-	r->type = TTYPE_PUNCT;
-	r->punct = punct;
-	return r;
+static void lex_error(char *msg) {
+	if(quiet)
+		failed = true;
+	else
+		perror(msg);
+}
+
+static int getch(void) {
+	return pos < srclen ? (unsigned char)src[pos++] : EOF;
 }
 
-static Token *make_int(int ival) {
-	Token *r = malloc(sizeof(Token));
-	r->type = TTYPE_INT;
-	r->ival = ival;
+static Token make_token(int type, int off, int len) {
+	Token r = {.type = type, .text = src + off, .len = len, .bol = bol};
+	bol = false;
 	return r;
 }
 
-static Token *make_char(char c) {
-	Token *r = malloc(sizeof(Token));
-	r->type = TTYPE_CHAR;
-	r->c = c;
+static Token make_punct(int punct, int off, int len) {
+	Token r = make_token(TTYPE_PUNCT, off, len);
+	r.punct = punct;
 	return r;
 }
 
+// 后面跟着next的时候是两个字符的运算符op，否则就是c自己
+static Token read_punct2(int c, int next, int op) {
+	if(src[pos] == next) {
+		pos++;
+		return make_punct(op, pos - 2, 2);
+	}
+	return make_punct(c, pos - 1, 1);
+}
+
+// 换行记到bol里，预处理指令要用；行尾的'\\'和注释都当成空白
 static void skip_space(void) {
-	int c;
-	while((c = getc(stdin)) != EOF) {
-		if(isspace(c))
-			continue;
-		ungetc(c, stdin);
-		return;
+	while(pos < srclen) {
+		char c = src[pos];
+		if(c == '\n') {
+			bol = true;
+			pos++;
+		} else if(isspace((unsigned char)c)) {
+			pos++;
+		} else if(c == '\\' && src[pos + 1] == '\n') {
+			pos += 2;
+		} else if(c == '/' && src[pos + 1] == '/') {
+			while(pos < srclen && src[pos] != '\n')
+				pos++;
+		} else if(c == '/' && src[pos + 1] == '*') {
+			char *end = strstr(src + pos + 2, "*/");
+			if(!end) {
+				lex_error("unterminated comment");
+				pos = srclen;
+				return;
+			}
+			pos = end - src + 2;
+		} else {
+			return;
+		}
 	}
 }
 
-static Token *read_number(char c) {
+static Token read_number(int c) {
+	int off = pos - 1;
 	int n = c - '0';
-	for(;;) {
-		int c = getc(stdin);
-		if(!isdigit(c)) {
-			ungetc(c, stdin);
-			return make_int(n);
-		}
-		n = n * 10 + (c - '0');
+	while(isdigit((unsigned char)src[pos]))
+		n = n * 10 + (src[pos++] - '0');
+	Token r = make_token(TTYPE_INT, off, pos - off);
+	r.ival = n;
+	return r;
+}
+
+// 转义序列'\c'表示的字符
+static char read_escaped(char c) {
+	switch(c) {
+		case 'n': return '\n';
+		case 't': return '\t';
+		case 'r': return '\r';
+		case '0': return '\0';
+		case 'a': return '\a';
+		case 'b': return '\b';
+		case 'f': return '\f';
+		case 'v': return '\v';
+		default: return c;
 	}
 }
 
-static Token *read_char(void) {
-	char c = getc(stdin);
-	if (c == EOF) goto err;
-	if (c == '\\') {
-		c = getc(stdin);
+static Token read_char(void) {
+	int off = pos - 1;
+	int c = getch();
+	if(c == EOF) goto err;
+	if(c == '\\') {
+		c = getch();
 		if(c == EOF) goto err;
+		c = read_escaped(c);
 	}
-	char c2 = getc(stdin);
-	if (c2 == EOF) goto err;
-	if (c2 != '\'')
-		perror("malformed char");
-	return make_char(c);
+	int c2 = getch();
+	if(c2 == EOF) goto err;
+	if(c2 != '\'')
+		lex_error("malformed char");
+	Token r = make_token(TTYPE_CHAR, off, pos - off);
+	r.c = c;
+	return r;
 err:
-	perror("unterminated char");
-	return NULL;
+	lex_error("unterminated char");
+	return make_token(TTYPE_EOF, pos, 0);
 }
 
-Token *peek_token(void) {
-	Token *token = read_token();
-	unget_token(token);
-	return token;
-}
-
-static Token *read_string(void) {
-	String *s = make_string();
+// 只找到结尾的'"'，转义留给token_string
+static Token read_string(void) {
+	int off = pos;
 	for(;;) {
-		int c = getc(stdin);
-		if(c == EOF) 
-			perror("unterminated string");
-		if(c == '"') {
-			break;
+		int c = getch();
+		if(c == EOF) {
+			lex_error("unterminated string");
+			return make_token(TTYPE_STRING, off, pos - off);
 		}
-		if(c == '\\') {
-			c = getc(stdin);
-			if (c == EOF)
-				perror("unterminated");
+		if(c == '"')
+			break;
+		if(c == '\\' && getch() == EOF) {
+			lex_error("unterminated");
+			return make_token(TTYPE_STRING, off, pos - off);
 		}
-		string_append(s, c);
 	}
-
-	return make_strtok(s);
+	return make_token(TTYPE_STRING, off, pos - off - 1);
 }
 
-static Token *read_ident(char c) {
-	String *s = make_string();
-	string_append(s, c);
-	for(;;) {
-		int c2 = getc(stdin);
-		if (isalnum(c2) || c2 == '_') {
-			string_append(s, c2);
-		} else {
-			ungetc(c2, stdin);
-			return make_ident(s);
-		}
-	}
+static Token read_ident(void) {
+	int off = pos - 1;
+	while(isalnum((unsigned char)src[pos]) || src[pos] == '_')
+		pos++;
+	return make_token(TTYPE_IDENT, off, pos - off);
 }
 
-static Token *read_token_int(void) {
+static Token lex_token(void) {
 	skip_space();
-	int c = getc(stdin);
+	int c = getch();
 	switch(c) {
 		case '0': case '1': case '2': case '3': case '4':
 		case '5': case '6': case '7': case '8': case '9':
@@ -138,132 +188,275 @@ static Token *read_token_int(void) {
 		case 'v': case 'w': case 'x': case 'y': case 'z': case 'A': case 'B':
 		case 'C': case 'D': case 'E': case 'F': case 'G': case 'H': case 'I':
 		case 'J': case 'K': case 'L': case 'M': case 'N': case 'O': case 'P':
-		case 'Q': case 'R': case 'S': case 'T': case 'U': case 'V': case 'W': 
+		case 'Q': case 'R': case 'S': case 'T': case 'U': case 'V': case 'W':
 		case 'X': case 'Y': case 'Z': case '_':
-			return read_ident(c);
-		case '/': case '=': case '*': case '+': case '-': case '(': case ')':
-		case ',': case ';': case '&': case '[': case ']': case '{': case '}':
-			return make_punct(c);
+			return read_ident();
+		case '/': case '*': case '%': case '+': case '-': case '(': case ')':
+		case ',': case ';': case '[': case ']': case '{': case '}':
+		case '#': case '.': case ':':
+			return make_punct(c, pos - 1, 1);
+		case '=':
+			return read_punct2(c, '=', PUNCT_EQ);
+		case '!':
+			return read_punct2(c, '=', PUNCT_NE);
+		case '<':
+			return read_punct2(c, '=', PUNCT_LE);
+		case '>':
+			return read_punct2(c, '=', PUNCT_GE);
+		case '&':
+			return read_punct2(c, '&', PUNCT_LOGAND);
+		case '|':
+			return read_punct2(c, '|', PUNCT_LOGOR);
 		case EOF:
-			return NULL;
+			return make_token(TTYPE_EOF, pos, 0);
 		default:
-			perror("unexpected character");
-			return NULL;
+			lex_error("unexpected character");
+			return make_token(TTYPE_EOF, pos, 0);
 	}
 }
 
-char *token_to_string(Token *tok) {
-	switch(tok->type) {
+// 整个文件切成token数组，最后一个是TTYPE_EOF。path是NULL的时候读标准输入
+SrcFile *lex_file(char *path) {
+	FILE *fp = path ? fopen(path, "r") : stdin;
+	if(!fp)
+		return NULL;
+	int len;
+	char *buf = read_source(fp, &len);
+	if(path)
+		fclose(fp);
+	return lex_buffer(path ? path : "-", buf, len);
+}
+
+// 一段token，starts是每个token在原文里开始的位置
+typedef struct {
+	Token *toks;
+	int *starts;
+	int n;
+	int nalloc;
+	int end;        // 块在原文里的结尾，是某一行的开头
+	int next;       // 结尾之后第一个token开始的位置，切到文件末尾的时候没有
+	bool next_bol;
+	bool failed;
+} Chunk;
+
+static void chunk_push(Chunk *c, Token tok, int start) {
+	if(c->n == c->nalloc) {
+		c->nalloc = c->nalloc ? c->nalloc * 2 : 64;
+		c->toks = realloc(c->toks, sizeof(Token) * c->nalloc);
+		c->starts = realloc(c->starts, sizeof(int) * c->nalloc);
+	}
+	c->toks[c->n] = tok;
+	c->starts[c->n++] = start;
+}
+
+// 从start开始切，直到下一个token在c->end或者之后，或者到了TTYPE_EOF。
+// 跨过结尾的token算这一块的，c->next记下结尾之后的第一个token
+static void lex_range(Chunk *c, char *buf, int len, int start, bool start_bol, bool spec) {
+	src = buf;
+	srclen = len;
+	pos = start;
+	bol = start_bol;
+	quiet = spec;
+	failed = false;
+	c->next = -1;
+	for(;;) {
+		skip_space();
+		if(failed)
+			break;
+		if(pos >= c->end && pos < srclen) {
+			c->next = pos;
+			c->next_bol = bol;
+			break;
+		}
+		int off = pos;
+		Token tok = lex_token();
+		if(failed)
+			break;
+		chunk_push(c, tok, off);
+		if(tok.type == TTYPE_EOF)
+			break;
+	}
+	c->failed = failed;
+}
+
+typedef struct {
+	Chunk *chunks;
+	char *buf;
+	int len;
+} Split;
+
+// 每一块都当作从行首开始、不在注释和字面量里面来切
+static void lex_chunk_task(int i, void *arg) {
+	Split *sp = arg;
+	int start = i ? sp->chunks[i - 1].end : 0;
+	lex_range(&sp->chunks[i], sp->buf, sp->len, start, true, true);
+}
+
+// c里从start开始的token，没有就是-1
+static int find_start(Chunk *c, int start) {
+	int lo = 0, hi = c->n;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(c->starts[mid] < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < c->n && c->starts[lo] == start ? lo : -1;
+}
+
+// 按行切成大约lex_chunk大的块，各自猜测着并行切分，再从头按顺序接起来。
+// 前一块实际切到的下一个token要是这一块里也有，从那里开始就和顺序切的一样，
+// 前面的丢掉，bol用前一块的；没有的话说明块的开头落在了注释或者字面量里，
+// 这一块从那个位置重新切。结果和顺序切分完全一样
+static Chunk lex_parallel(char *buf, int len) {
+	int nchunks = 0;
+	Chunk *chunks = NULL;
+	for(int start = 0; start < len; ) {
+		int end = start + lex_chunk;
+		if(end >= len) {
+			end = len;
+		} else {
+			char *nl = memchr(buf + end, '\n', len - end);
+			end = nl ? nl - buf + 1 : len;
+		}
+		chunks = realloc(chunks, sizeof(Chunk) * (nchunks + 1));
+		chunks[nchunks] = (Chunk){.end = end};
+		nchunks++;
+		start = end;
+	}
+	Split sp = {chunks, buf, len};
+	run_parallel(nchunks, lex_chunk_task, &sp);
+
+	Chunk r = {0};
+	int sync = 0;
+	bool sync_bol = true;
+	for(int i = 0; i < nchunks; i++) {
+		Chunk *c = &chunks[i];
+		// 前一块的最后一个token把这一块整个盖住了
+		if(i && sync >= c->end && i + 1 < nchunks)
+			continue;
+		int k = c->failed ? -1 : i ? find_start(c, sync) : 0;
+		Chunk redo = {.end = c->end};
+		if(k < 0) {
+			lex_range(&redo, buf, len, sync, sync_bol, false);
+			c = &redo;
+			k = 0;
+		}
+		if(k < c->n)
+			c->toks[k].bol = sync_bol;
+		for(; k < c->n; k++)
+			chunk_push(&r, c->toks[k], c->starts[k]);
+		bool eof = c->n && c->toks[c->n - 1].type == TTYPE_EOF;
+		sync = c->next;
+		sync_bol = c->next_bol;
+		free(redo.toks);
+		free(redo.starts);
+		if(eof)
+			break;
+	}
+	for(int i = 0; i < nchunks; i++) {
+		free(chunks[i].toks);
+		free(chunks[i].starts);
+	}
+	free(chunks);
+	return r;
+}
+
+// 已经读进来的原文，buf要一直留着
+SrcFile *lex_buffer(char *path, char *buf, int len) {
+	Chunk c = {.end = len};
+	if(lex_chunk > 0 && len > lex_chunk)
+		c = lex_parallel(buf, len);
+	else
+		lex_range(&c, buf, len, 0, true, false);
+	free(c.starts);
+	SrcFile *r = calloc(1, sizeof(SrcFile));
+	r->path = path;
+	r->src = buf;
+	r->len = len;
+	r->toks = c.toks;
+	r->ntoks = c.n;
+	return r;
+}
+
+// 标识符的文本，要留在AST里的时候才复制出来
+char *token_ident(Token tok) {
+	char *r = malloc(tok.len + 1);
+	memcpy(r, tok.text, tok.len);
+	r[tok.len] = '\0';
+	return r;
+}
+
+// 解开字符串字面量里的转义，没有转义的时候就是原文的拷贝
+char *token_string(Token tok) {
+	char *r = malloc(tok.len + 1);
+	char *p = tok.text;
+	char *end = p + tok.len;
+	int n = 0;
+	while(p < end) {
+		if(*p == '\\' && p + 1 < end) {
+			r[n++] = read_escaped(p[1]);
+			p += 2;
+		} else {
+			r[n++] = *p++;
+		}
+	}
+	r[n] = '\0';
+	return r;
+}
+
+char *token_to_string(Token tok) {
+	switch(tok.type) {
 		case TTYPE_IDENT:
-			return tok->sval;
+			return token_ident(tok);
 		case TTYPE_PUNCT:
+			switch(tok.punct) {
+				case PUNCT_EQ: return "==";
+				case PUNCT_NE: return "!=";
+				case PUNCT_LE: return "<=";
+				case PUNCT_GE: return ">=";
+				case PUNCT_LOGAND: return "&&";
+				case PUNCT_LOGOR: return "||";
+				default: {
+					String *s = make_string();
+					string_append(s, tok.punct);
+					return get_cstring(s);
+				}
+			}
 		case TTYPE_CHAR: {
 			String *s = make_string();
-			string_append(s, tok->c);
+			string_append(s, tok.c);
 			return get_cstring(s);
 		}
 		case TTYPE_INT: {
 			String *s = make_string();
-			string_appendf(s, "%d", tok->ival);
+			string_appendf(s, "%d", tok.ival);
 			return get_cstring(s);
 		}
 		case TTYPE_STRING : {
 			String *s = make_string();
-			string_appendf(s, "\"%s\"", tok->sval);
+			string_appendf(s, "\"%.*s\"", tok.len, tok.text);
 			return get_cstring(s);
 		}
+		case TTYPE_EOF:
+			return "(eof)";
 		default:
 			perror("internal error");
 			return NULL;
 	}
 }
 
-bool is_punct(Token *tok, char c) {
-	if(!tok) 
-		perror("token is null");
-	return tok->type == TTYPE_PUNCT && tok->punct == c;
+bool is_punct(Token tok, int c) {
+	return tok.type == TTYPE_PUNCT && tok.punct == c;
 }
 
-bool is_one_punct(Token *tok) {
-	if(!tok)
-		return false;
-	return tok->type == TTYPE_PUNCT;
+bool is_one_punct(Token tok) {
+	return tok.type == TTYPE_PUNCT;
 }
 
-void unget_token(Token *tok) {
-	if(ungotten) 
-		perror("push back buffer is all");
-	ungotten = tok;
-}
-
-Token *read_token(void) {
-
-	if(ungotten) {
-		Token *tok = ungotten;
-		ungotten = NULL;
-		return tok;
-	}
-
-	return read_token_int();
+// 和关键字比较，不用复制文本
+bool is_ident(Token tok, char *s) {
+	return tok.type == TTYPE_IDENT && (int)strlen(s) == tok.len &&
+		!memcmp(tok.text, s, tok.len);
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -0,0 +1,997 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cc.h"
+
+// 在生成代码之前对每个函数的Ast做的变换。
+// 只改这个函数自己的Ast，状态都是每个线程一份，函数之间可以并行
+
+static __thread Ast *cur_func;
+static __thread Ast *last_local;    // localvars的最后一个，临时变量接在后面
+static __thread int ntemps;
+
+// 变量的集合，按指针散列，开放寻址
+typedef struct {
+    Ast **slots;
+    int n;
+    int cap;
+} VarSet;
+
+// 循环里会被改写的东西
+typedef struct {
+    VarSet vars;        // 赋值或声明过的变量
+    bool has_call;      // 调用的函数可能改全局变量和取过地址的局部变量
+    bool has_store;     // 通过指针写内存
+} Writes;
+
+// 取过地址的局部变量，通过指针写内存的时候可能被改掉
+static __thread VarSet addr_taken;
+
+static unsigned hash_ptr(void *p) {
+    return ((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ull >> 32;
+}
+
+static void add_var(VarSet *s, Ast *var) {
+    if((s->n + 1) * 2 > s->cap) {
+        int oldcap = s->cap;
+        Ast **old = s->slots;
+        s->cap = oldcap ? oldcap * 2 : 16;
+        s->slots = calloc(s->cap, sizeof(Ast *));
+        s->n = 0;
+        for(int i = 0; i < oldcap; i++) {
+            if(old[i])
+                add_var(s, old[i]);
+        }
+        free(old);
+    }
+    unsigned h = hash_ptr(var) & (s->cap - 1);
+    for(; s->slots[h]; h = (h + 1) & (s->cap - 1)) {
+        if(s->slots[h] == var)
+            return;
+    }
+    s->slots[h] = var;
+    s->n++;
+}
+
+static bool has_var(VarSet *s, Ast *var) {
+    if(!s->cap)
+        return false;
+    unsigned h = hash_ptr(var) & (s->cap - 1);
+    for(; s->slots[h]; h = (h + 1) & (s->cap - 1)) {
+        if(s->slots[h] == var)
+            return true;
+    }
+    return false;
+}
+
+static void clear_vars(VarSet *s) {
+    free(s->slots);
+    s->slots = NULL;
+    s->n = s->cap = 0;
+}
+
+static void collect_block(Ast **block, Writes *w);
+
+static void collect_writes(Ast *ast, Writes *w) {
+    if(!ast)
+        return;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_LVAR:
+        case AST_GVAR:
+        case AST_ARRAY_INIT:
+            return;
+        case AST_ADDR:
+            if(ast->operand->type == AST_LVAR || ast->operand->type == AST_GVAR)
+                add_var(&addr_taken, ast->operand);
+            collect_writes(ast->operand, w);
+            return;
+        case AST_DEREF:
+        case AST_RETURN:
+        case '!':
+            collect_writes(ast->operand, w);
+            return;
+        case AST_FUNCALL:
+            w->has_call = true;
+            for(int i = 0; i < ast->nargs; i++)
+                collect_writes(ast->args[i], w);
+            return;
+        case AST_DECL:
+            add_var(&w->vars, ast->decl_var);
+            collect_writes(ast->decl_init, w);
+            return;
+        case AST_IF:
+            collect_writes(ast->cond, w);
+            collect_block(ast->then, w);
+            collect_block(ast->els, w);
+            return;
+        case AST_WHILE:
+        case AST_FOR:
+            collect_writes(ast->forinit, w);
+            collect_block(ast->forpre, w);
+            collect_writes(ast->forcond, w);
+            collect_writes(ast->forstep, w);
+            collect_block(ast->forbody, w);
+            return;
+        case AST_SWITCH:
+            collect_writes(ast->swcond, w);
+            collect_block(ast->swbody, w);
+            return;
+        case AST_CASE:
+        case AST_DEFAULT:
+        case AST_BREAK:
+            return;
+        case '=':
+            if(ast->left->type == AST_DEREF)
+                w->has_store = true;
+            else
+                add_var(&w->vars, ast->left);
+            collect_writes(ast->left, w);
+            collect_writes(ast->right, w);
+            return;
+        default:
+            collect_writes(ast->left, w);
+            collect_writes(ast->right, w);
+    }
+}
+
+static void collect_block(Ast **block, Writes *w) {
+    if(!block)
+        return;
+    for(int i = 0; block[i]; i++)
+        collect_writes(block[i], w);
+}
+
+// 变量的值在循环里不会变
+static bool var_invariant(Ast *var, Writes *w) {
+    // 数组取的是首地址
+    if(var->ctype->type == CTYPE_ARRAY)
+        return true;
+    if(has_var(&w->vars, var))
+        return false;
+    bool escaped = var->type == AST_GVAR || has_var(&addr_taken, var);
+    return !(escaped && (w->has_call || w->has_store));
+}
+
+// 循环不变量。外提以后进循环之前就会算，所以只认没有副作用、
+// 也不会出错的表达式：不解引用，除数只能是非0的常量
+static bool is_invariant(Ast *ast, Writes *w) {
+    long val;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+            return true;
+        case AST_LVAR:
+        case AST_GVAR:
+            return var_invariant(ast, w);
+        case AST_ADDR:
+            // 变量的地址是固定的
+            if(ast->operand->type == AST_LVAR || ast->operand->type == AST_GVAR)
+                return true;
+            return false;
+        case '!':
+            return is_invariant(ast->operand, w);
+        case '+': case '-': case '*':
+        case '<': case '>': case PUNCT_EQ: case PUNCT_NE: case PUNCT_LE: case PUNCT_GE:
+        case PUNCT_LOGAND: case PUNCT_LOGOR:
+            return is_invariant(ast->left, w) && is_invariant(ast->right, w);
+        case '/': case '%':
+            if(!eval_const(ast->right, &val) || val == 0 || val == -1)
+                return false;
+            return is_invariant(ast->left, w);
+        default:
+            return false;
+    }
+}
+
+// 单条指令就能取到的值，放到临时变量里也快不了
+static bool is_leaf(Ast *ast) {
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_LVAR:
+        case AST_GVAR:
+        case AST_ADDR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static Ast *make_literal(Ctype *ctype, int val) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = AST_LITERAL;
+    r->ctype = ctype;
+    if(ctype->type == CTYPE_CHAR)
+        r->c = val;
+    else
+        r->ival = val;
+    return r;
+}
+
+// 临时变量挂在函数的局部变量后面，栈槽由layout_frame分配
+static Ast *make_temp(Ctype *ctype) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = AST_LVAR;
+    r->ctype = ctype;
+    r->lname = malloc(16);
+    snprintf(r->lname, 16, ".t%d", ntemps++);
+    r->loff = 0;
+    r->lver = 0;
+    r->lreg = 0;
+    r->next = NULL;
+    if(last_local)
+        last_local->next = r;
+    else
+        cur_func->localvars = r;
+    last_local = r;
+    return r;
+}
+
+static Ast *make_assign(Ast *var, Ast *val) {
+    Ast *r = malloc(sizeof(Ast));
+    r->type = '=';
+    r->ctype = var->ctype;
+    r->left = var;
+    r->right = val;
+    return r;
+}
+
+static void add_pre(Ast *loop, Ast *stmt) {
+    int n = 0;
+    if(loop->forpre)
+        while(loop->forpre[n])
+            n++;
+    loop->forpre = realloc(loop->forpre, sizeof(Ast *) * (n + 2));
+    loop->forpre[n] = stmt;
+    loop->forpre[n + 1] = NULL;
+}
+
+// 把*slot里最大的不变子表达式换掉：常量直接算出来，其他的放进preheader
+static void hoist(Ast **slot, Ast *loop, Writes *w) {
+    Ast *ast = *slot;
+    long val;
+    if(!ast)
+        return;
+    if(is_invariant(ast, w)) {
+        if(is_leaf(ast))
+            return;
+        if(ast->ctype->type == CTYPE_INT && eval_const(ast, &val)) {
+            *slot = make_literal(ast->ctype, val);
+            return;
+        }
+        Ast *tmp = make_temp(ast->ctype);
+        add_pre(loop, make_assign(tmp, ast));
+        *slot = tmp;
+        return;
+    }
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_LVAR:
+        case AST_GVAR:
+        case AST_ARRAY_INIT:
+            return;
+        case AST_ADDR:
+            if(ast->operand->type == AST_DEREF)
+                hoist(&ast->operand->operand, loop, w);
+            return;
+        case AST_DEREF:
+        case AST_RETURN:
+        case '!':
+            hoist(&ast->operand, loop, w);
+            return;
+        case AST_FUNCALL:
+            for(int i = 0; i < ast->nargs; i++)
+                hoist(&ast->args[i], loop, w);
+            return;
+        case AST_DECL:
+            if(ast->decl_init && ast->decl_init->type != AST_ARRAY_INIT)
+                hoist(&ast->decl_init, loop, w);
+            return;
+        case AST_IF:
+            hoist(&ast->cond, loop, w);
+            if(ast->then)
+                for(int i = 0; ast->then[i]; i++)
+                    hoist(&ast->then[i], loop, w);
+            if(ast->els)
+                for(int i = 0; ast->els[i]; i++)
+                    hoist(&ast->els[i], loop, w);
+            return;
+        case AST_WHILE:
+        case AST_FOR:
+            hoist(&ast->forinit, loop, w);
+            if(ast->forpre)
+                for(int i = 0; ast->forpre[i]; i++)
+                    hoist(&ast->forpre[i], loop, w);
+            hoist(&ast->forcond, loop, w);
+            hoist(&ast->forstep, loop, w);
+            for(int i = 0; ast->forbody[i]; i++)
+                hoist(&ast->forbody[i], loop, w);
+            return;
+        case AST_SWITCH:
+            hoist(&ast->swcond, loop, w);
+            for(int i = 0; ast->swbody[i]; i++)
+                hoist(&ast->swbody[i], loop, w);
+            return;
+        case AST_CASE:
+        case AST_DEFAULT:
+        case AST_BREAK:
+            return;
+        case '=':
+            // 左边是要写的地方，只有解引用的地址可以外提
+            if(ast->left->type == AST_DEREF)
+                hoist(&ast->left->operand, loop, w);
+            hoist(&ast->right, loop, w);
+            return;
+        default:
+            hoist(&ast->left, loop, w);
+            hoist(&ast->right, loop, w);
+    }
+}
+
+static void licm(Ast *loop) {
+    Writes w = {{NULL, 0, 0}, false, false};
+    collect_writes(loop->forcond, &w);
+    collect_writes(loop->forstep, &w);
+    collect_block(loop->forbody, &w);
+
+    hoist(&loop->forcond, loop, &w);
+    hoist(&loop->forstep, loop, &w);
+    for(int i = 0; loop->forbody[i]; i++)
+        hoist(&loop->forbody[i], loop, &w);
+    clear_vars(&w.vars);
+}
+
+// 常量和复制传播：按语句的顺序记下局部变量当前的值是哪个字面量，
+// 或者和哪个变量相同，用来替换后面的引用，然后重新折叠常量。
+// 最后没人再读的变量，对它的赋值就删掉
+typedef struct {
+    Ast *var;
+    Ast *val;           // AST_LITERAL或者AST_LVAR
+    int ver;            // val是变量的时候它当时的lver，变了这条就不算了
+} Fact;
+
+// 按var散列，开放寻址，每个变量最多一条
+typedef struct {
+    Fact *facts;
+    int n;
+    int cap;
+} Env;
+
+// 只跟踪没取过地址的标量局部变量，其他途径改不到它们
+static bool is_tracked(Ast *var) {
+    if(var->type != AST_LVAR)
+        return false;
+    int t = var->ctype->type;
+    if(t != CTYPE_INT && t != CTYPE_CHAR && t != CTYPE_PTR)
+        return false;
+    return !has_var(&addr_taken, var);
+}
+
+static bool same_type(Ctype *a, Ctype *b) {
+    if(a->type != b->type)
+        return false;
+    if(a->type == CTYPE_ARRAY && a->size != b->size)
+        return false;
+    if(a->type == CTYPE_PTR || a->type == CTYPE_ARRAY)
+        return same_type(a->ptr, b->ptr);
+    return true;
+}
+
+static Env env_new(int cap) {
+    Env r = {calloc(cap, sizeof(Fact)), 0, cap};
+    return r;
+}
+
+static Env env_copy(Env *env) {
+    Env r = {malloc(sizeof(Fact) * env->cap), env->n, env->cap};
+    memcpy(r.facts, env->facts, sizeof(Fact) * env->cap);
+    return r;
+}
+
+static Fact *env_find(Env *env, Ast *var) {
+    unsigned h = hash_ptr(var) & (env->cap - 1);
+    for(; env->facts[h].var; h = (h + 1) & (env->cap - 1)) {
+        if(env->facts[h].var == var)
+            return &env->facts[h];
+    }
+    return NULL;
+}
+
+static void env_put(Env *env, Fact f) {
+    if((env->n + 1) * 2 > env->cap) {
+        Env old = *env;
+        *env = env_new(old.cap * 2);
+        for(int i = 0; i < old.cap; i++) {
+            if(old.facts[i].var)
+                env_put(env, old.facts[i]);
+        }
+        free(old.facts);
+    }
+    unsigned h = hash_ptr(f.var) & (env->cap - 1);
+    while(env->facts[h].var && env->facts[h].var != f.var)
+        h = (h + 1) & (env->cap - 1);
+    if(!env->facts[h].var)
+        env->n++;
+    env->facts[h] = f;
+}
+
+static Ast *env_get(Env *env, Ast *var) {
+    Fact *f = env_find(env, var);
+    if(!f || (f->val->type == AST_LVAR && f->val->lver != f->ver))
+        return NULL;
+    return f->val;
+}
+
+// var被改写了，它的值和复制自它的变量都不再可信。
+// 复制自它的那些靠lver变了来作废，不用一条条找
+static void env_kill(Env *env, Ast *var) {
+    var->lver++;
+    Fact *f = env_find(env, var);
+    if(!f)
+        return;
+    // 删掉以后把后面同一串的重新放一遍
+    int i = f - env->facts;
+    f->var = NULL;
+    env->n--;
+    for(i = (i + 1) & (env->cap - 1); env->facts[i].var; i = (i + 1) & (env->cap - 1)) {
+        Fact g = env->facts[i];
+        env->facts[i].var = NULL;
+        env->n--;
+        env_put(env, g);
+    }
+}
+
+static bool same_value(Ast *a, Ast *b) {
+    long x, y;
+    if(a->type == AST_LITERAL && b->type == AST_LITERAL)
+        return eval_const(a, &x) && eval_const(b, &y) && x == y;
+    return a == b;
+}
+
+// if/else汇合的地方只留两边都成立的
+static void env_join(Env *env, Env *a, Env *b) {
+    free(env->facts);
+    *env = env_new(16);
+    for(int i = 0; i < a->cap; i++) {
+        Fact *f = &a->facts[i];
+        if(!f->var || !env_get(a, f->var))
+            continue;
+        Ast *val = env_get(b, f->var);
+        if(val && same_value(val, f->val))
+            env_put(env, *f);
+    }
+}
+
+// var = val之后var的值，字面量要按var的类型截断
+static void env_set(Env *env, Ast *var, Ast *val) {
+    long v;
+    int t = var->ctype->type;
+    Fact f = {var, NULL, 0};
+    if(val->type == AST_LITERAL && (t == CTYPE_INT || t == CTYPE_CHAR)) {
+        eval_const(val, &v);
+        f.val = make_literal(var->ctype, t == CTYPE_CHAR ? (char)v : (int)v);
+    } else if(val != var && is_tracked(val) && same_type(var->ctype, val->ctype)) {
+        f.val = val;
+        f.ver = val->lver;
+    } else {
+        return;
+    }
+    env_put(env, f);
+}
+
+static void fold(Ast **slot) {
+    Ast *ast = *slot;
+    long val;
+    if(ast->type != AST_LITERAL && ast->ctype && ast->ctype->type == CTYPE_INT &&
+       eval_const(ast, &val))
+        *slot = make_literal(ast->ctype, val);
+}
+
+static void kill_assigned(Ast *ast, Env *env);
+
+// 替换表达式里读到的变量。同一条语句里的赋值要等整条语句结束才算数，
+// 因为参数之类的求值顺序是不确定的。&&和||是顺序点，左边赋值过的变量
+// 在右边就不知道值了
+static void subst(Ast **slot, Env *env) {
+    Ast *ast = *slot;
+    Ast *val;
+    if(!ast)
+        return;
+    switch(ast->type) {
+        case AST_LVAR:
+            if((val = env_get(env, ast)))
+                *slot = val;
+            return;
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_GVAR:
+        case AST_ARRAY_INIT:
+            return;
+        case AST_ADDR:
+            if(ast->operand->type == AST_DEREF)
+                subst(&ast->operand->operand, env);
+            return;
+        case AST_DEREF:
+        case '!':
+            subst(&ast->operand, env);
+            break;
+        case AST_FUNCALL:
+            for(int i = 0; i < ast->nargs; i++)
+                subst(&ast->args[i], env);
+            return;
+        case '=':
+            if(ast->left->type == AST_DEREF)
+                subst(&ast->left->operand, env);
+            subst(&ast->right, env);
+            return;
+        case PUNCT_LOGAND:
+        case PUNCT_LOGOR:
+            subst(&ast->left, env);
+            kill_assigned(ast->left, env);
+            subst(&ast->right, env);
+            break;
+        default:
+            subst(&ast->left, env);
+            subst(&ast->right, env);
+    }
+    fold(slot);
+}
+
+// 表达式里所有被赋值的变量
+static void kill_assigned(Ast *ast, Env *env) {
+    if(!ast)
+        return;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_LVAR:
+        case AST_GVAR:
+            return;
+        case AST_ADDR:
+        case AST_DEREF:
+        case '!':
+            kill_assigned(ast->operand, env);
+            return;
+        case AST_FUNCALL:
+            for(int i = 0; i < ast->nargs; i++)
+                kill_assigned(ast->args[i], env);
+            return;
+        case '=':
+            if(ast->left->type == AST_LVAR)
+                env_kill(env, ast->left);
+            kill_assigned(ast->left, env);
+            kill_assigned(ast->right, env);
+            return;
+        default:
+            kill_assigned(ast->left, env);
+            kill_assigned(ast->right, env);
+    }
+}
+
+// 改写过的变量都不知道值了
+static void kill_writes(Env *env, Writes *w) {
+    for(int i = 0; i < w->vars.cap; i++) {
+        if(w->vars.slots[i])
+            env_kill(env, w->vars.slots[i]);
+    }
+}
+
+static void prop_block(Ast **block, Env *env);
+
+static void prop_stmt(Ast **slot, Env *env) {
+    Ast *ast = *slot;
+    long val;
+    switch(ast->type) {
+        case AST_DECL: {
+            Ast *var = ast->decl_var;
+            bool scalar = ast->decl_init && ast->decl_init->type != AST_ARRAY_INIT;
+            if(scalar) {
+                subst(&ast->decl_init, env);
+                kill_assigned(ast->decl_init, env);
+            }
+            env_kill(env, var);
+            if(scalar && is_tracked(var))
+                env_set(env, var, ast->decl_init);
+            return;
+        }
+        case AST_IF: {
+            subst(&ast->cond, env);
+            kill_assigned(ast->cond, env);
+            Env then = env_copy(env);
+            Env els = env_copy(env);
+            prop_block(ast->then, &then);
+            prop_block(ast->els, &els);
+            if(eval_const(ast->cond, &val)) {
+                free(env->facts);
+                *env = val ? then : els;
+                free(val ? els.facts : then.facts);
+            } else {
+                env_join(env, &then, &els);
+                free(then.facts);
+                free(els.facts);
+            }
+            return;
+        }
+        case AST_WHILE:
+        case AST_FOR: {
+            if(ast->forinit)
+                prop_stmt(&ast->forinit, env);
+            // 循环里改写的变量，进循环的时候就不知道值了
+            Writes w = {{NULL, 0, 0}, false, false};
+            collect_writes(ast->forcond, &w);
+            collect_writes(ast->forstep, &w);
+            collect_block(ast->forbody, &w);
+            kill_writes(env, &w);
+            clear_vars(&w.vars);
+            subst(&ast->forcond, env);
+            subst(&ast->forstep, env);
+            Env body = env_copy(env);
+            prop_block(ast->forbody, &body);
+            free(body.facts);
+            return;
+        }
+        case AST_SWITCH: {
+            subst(&ast->swcond, env);
+            kill_assigned(ast->swcond, env);
+            // 每个case既可能从分派跳进来，也可能从上一个case落下来，
+            // break又可以从任何地方跳出去：switch里改写的变量，
+            // 在case的地方和switch之后都不知道值了
+            Writes w = {{NULL, 0, 0}, false, false};
+            collect_block(ast->swbody, &w);
+            kill_writes(env, &w);
+            Env body = env_copy(env);
+            for(int i = 0; ast->swbody[i]; i++) {
+                int t = ast->swbody[i]->type;
+                if(t == AST_CASE || t == AST_DEFAULT)
+                    kill_writes(&body, &w);
+                else
+                    prop_stmt(&ast->swbody[i], &body);
+            }
+            free(body.facts);
+            clear_vars(&w.vars);
+            return;
+        }
+        case AST_CASE:
+        case AST_DEFAULT:
+        case AST_BREAK:
+            return;
+        case AST_RETURN:
+            subst(&ast->operand, env);
+            return;
+        default:
+            subst(slot, env);
+            ast = *slot;
+            kill_assigned(ast, env);
+            if(ast->type == '=' && is_tracked(ast->left))
+                env_set(env, ast->left, ast->right);
+    }
+}
+
+static void prop_block(Ast **block, Env *env) {
+    if(!block)
+        return;
+    for(int i = 0; block[i]; i++)
+        prop_stmt(&block[i], env);
+}
+
+// 传播完以后还被读的变量
+static __thread VarSet live_vars;
+
+static void count_block(Ast **block);
+
+static void count_reads(Ast *ast) {
+    if(!ast)
+        return;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_GVAR:
+        case AST_ARRAY_INIT:
+            return;
+        case AST_LVAR:
+            add_var(&live_vars, ast);
+            return;
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_RETURN:
+        case '!':
+            count_reads(ast->operand);
+            return;
+        case AST_FUNCALL:
+            for(int i = 0; i < ast->nargs; i++)
+                count_reads(ast->args[i]);
+            return;
+        case AST_DECL:
+            count_reads(ast->decl_init);
+            return;
+        case AST_IF:
+            count_reads(ast->cond);
+            count_block(ast->then);
+            count_block(ast->els);
+            return;
+        case AST_WHILE:
+        case AST_FOR:
+            count_reads(ast->forinit);
+            count_reads(ast->forcond);
+            count_reads(ast->forstep);
+            count_block(ast->forbody);
+            return;
+        case AST_SWITCH:
+            count_reads(ast->swcond);
+            count_block(ast->swbody);
+            return;
+        case AST_CASE:
+        case AST_DEFAULT:
+        case AST_BREAK:
+            return;
+        case '=':
+            // 左边的变量是写，不算
+            if(ast->left->type != AST_LVAR)
+                count_reads(ast->left);
+            count_reads(ast->right);
+            return;
+        default:
+            count_reads(ast->left);
+            count_reads(ast->right);
+    }
+}
+
+static void count_block(Ast **block) {
+    if(!block)
+        return;
+    for(int i = 0; block[i]; i++)
+        count_reads(block[i]);
+}
+
+static bool has_side_effect(Ast *ast) {
+    if(!ast)
+        return false;
+    switch(ast->type) {
+        case AST_LITERAL:
+        case AST_STRING:
+        case AST_LVAR:
+        case AST_GVAR:
+            return false;
+        case AST_FUNCALL:
+        case '=':
+            return true;
+        case AST_ADDR:
+        case AST_DEREF:
+        case '!':
+            return has_side_effect(ast->operand);
+        default:
+            return has_side_effect(ast->left) || has_side_effect(ast->right);
+    }
+}
+
+static bool is_dead(Ast *var) {
+    return is_tracked(var) && !has_var(&live_vars, var);
+}
+
+// 删掉没人读的变量的赋值。tail表示block的最后一条语句的值可能被用到：
+// 顶层语句组成的main把最后的值当返回值
+static void remove_dead(Ast **block, bool tail) {
+    if(!block)
+        return;
+    int n = 0;
+    for(int i = 0; block[i]; i++) {
+        Ast *ast = block[i];
+        bool last = tail && !block[i + 1];
+        switch(ast->type) {
+            case AST_DECL:
+                if(!last && (!ast->decl_init || ast->decl_init->type != AST_ARRAY_INIT) &&
+                   is_dead(ast->decl_var)) {
+                    if(has_side_effect(ast->decl_init))
+                        block[n++] = ast->decl_init;
+                    continue;
+                }
+                break;
+            case '=':
+                if(!last && ast->left->type == AST_LVAR && is_dead(ast->left)) {
+                    if(has_side_effect(ast->right))
+                        block[n++] = ast->right;
+                    continue;
+                }
+                break;
+            case AST_IF:
+                remove_dead(ast->then, last);
+                remove_dead(ast->els, last);
+                break;
+            case AST_WHILE:
+            case AST_FOR:
+                remove_dead(ast->forbody, false);
+                break;
+            case AST_SWITCH:
+                // 是最后一条的话，不知道里面哪条语句的值会留下来
+                if(!last)
+                    remove_dead(ast->swbody, false);
+                break;
+        }
+        block[n++] = ast;
+    }
+    block[n] = NULL;
+}
+
+static void propagate(Ast *func) {
+    Env env = env_new(16);
+    prop_block(func->body, &env);
+    free(env.facts);
+
+    clear_vars(&live_vars);
+    count_block(func->body);
+    remove_dead(func->body, true);
+}
+
+// 向量化只认这种形状：for(i = 起始; i < n; i = i + 1)，循环体里只有
+//   *(a + i) = 表达式;     逐个元素计算，或者填充
+//   s = s + 表达式;        int的求和
+// 表达式由*(b + i)、循环不变的标量、字面量和+ - *组成，元素的类型都一样，
+// 所以每次迭代只碰下标i的元素，迭代之间没有依赖。
+// 指针指向的内存会不会重叠这里不知道，由生成的代码在运行时检查
+static __thread Ast *vec_index;
+static __thread int vec_elem;
+
+// *(base + i)，base是数组或者循环里不变的指针
+static bool is_vec_elem(Ast *ast, Writes *w) {
+    if(ast->type != AST_DEREF || ast->operand->type != '+')
+        return false;
+    Ast *base = ast->operand->left;
+    Ast *idx = ast->operand->right;
+    if(idx != vec_index) {
+        base = ast->operand->right;
+        idx = ast->operand->left;
+    }
+    if(idx != vec_index || base->type != AST_LVAR)
+        return false;
+    if(base->ctype->type != CTYPE_ARRAY &&
+       (base->ctype->type != CTYPE_PTR || !var_invariant(base, w)))
+        return false;
+    int t = ast->ctype->type;
+    if(t != CTYPE_INT && t != CTYPE_CHAR)
+        return false;
+    if(vec_elem < 0)
+        vec_elem = t;
+    return t == vec_elem;
+}
+
+static bool is_vec_expr(Ast *ast, Writes *w, bool *has_mul) {
+    switch(ast->type) {
+        case AST_LITERAL:
+            return true;
+        case AST_LVAR:
+            if(ast == vec_index)
+                return false;
+            if(ast->ctype->type != CTYPE_INT && ast->ctype->type != CTYPE_CHAR)
+                return false;
+            return var_invariant(ast, w);
+        case AST_DEREF:
+            return is_vec_elem(ast, w);
+        case '*':
+            *has_mul = true;
+            // fall through
+        case '+': case '-':
+            return is_vec_expr(ast->left, w, has_mul) && is_vec_expr(ast->right, w, has_mul);
+        default:
+            return false;
+    }
+}
+
+// s = s + e，s是只在这条语句里出现的int局部变量
+static bool is_vec_reduction(Ast *ast, Ast *loop, Writes *w, bool *has_mul) {
+    Ast *s = ast->left;
+    if(s == vec_index || s->ctype->type != CTYPE_INT || !is_tracked(s))
+        return false;
+    Ast *rhs = ast->right;
+    if(rhs->type != '+')
+        return false;
+    Ast *e = rhs->left == s ? rhs->right : rhs->left;
+    if(rhs->left != s && rhs->right != s)
+        return false;
+    if(!is_vec_expr(e, w, has_mul))
+        return false;
+    // s在循环里别的地方被用到的话就不能拆开算
+    for(int i = 0; loop->forbody[i]; i++) {
+        if(loop->forbody[i] == ast)
+            continue;
+        Writes tmp = {{NULL, 0, 0}, false, false};
+        collect_writes(loop->forbody[i], &tmp);
+        bool written = has_var(&tmp.vars, s);
+        clear_vars(&tmp.vars);
+        if(written)
+            return false;
+    }
+    return true;
+}
+
+static void check_vectorizable(Ast *loop) {
+    Ast *init = loop->forinit;
+    Ast *cond = loop->forcond;
+    Ast *step = loop->forstep;
+    if(!init || !cond || !step)
+        return;
+    Ast *i = init->type == AST_DECL ? init->decl_var :
+             init->type == '=' ? init->left : NULL;
+    if(!i || i->type != AST_LVAR || i->ctype->type != CTYPE_INT || !is_tracked(i))
+        return;
+    if(init->type == AST_DECL && (!init->decl_init || init->decl_init->type == AST_ARRAY_INIT))
+        return;
+    if(cond->type != '<' || cond->left != i)
+        return;
+    if(step->type != '=' || step->left != i || step->right->type != '+')
+        return;
+    Ast *l = step->right->left, *r = step->right->right;
+    long one;
+    if(!((l == i && eval_const(r, &one) && one == 1) || (r == i && eval_const(l, &one) && one == 1)))
+        return;
+
+    Writes w = {{NULL, 0, 0}, false, false};
+    collect_writes(cond, &w);
+    collect_writes(step, &w);
+    collect_block(loop->forbody, &w);
+    vec_index = i;
+    vec_elem = -1;
+    bool ok = is_invariant(cond->right, &w) && loop->forbody[0];
+    bool has_mul = false;
+    bool has_reduction = false;
+    for(int k = 0; ok && loop->forbody[k]; k++) {
+        Ast *ast = loop->forbody[k];
+        if(ast->type != '=') {
+            ok = false;
+        } else if(ast->left->type == AST_DEREF) {
+            ok = is_vec_elem(ast->left, &w) && is_vec_expr(ast->right, &w, &has_mul);
+        } else if(ast->left->type == AST_LVAR) {
+            ok = is_vec_reduction(ast, loop, &w, &has_mul);
+            has_reduction = true;
+        } else {
+            ok = false;
+        }
+    }
+    clear_vars(&w.vars);
+    // char的乘法和求和要扩展位数，SSE2没有直接的指令
+    if(vec_elem == CTYPE_CHAR && (has_mul || has_reduction))
+        ok = false;
+    loop->forvec = ok && vec_elem >= 0;
+}
+
+// 里层的循环先做，外提到里层preheader的表达式还可以继续往外提
+static void opt_block(Ast **block) {
+    if(!block)
+        return;
+    for(int i = 0; block[i]; i++) {
+        Ast *ast = block[i];
+        switch(ast->type) {
+            case AST_IF:
+                opt_block(ast->then);
+                opt_block(ast->els);
+                break;
+            case AST_WHILE:
+            case AST_FOR:
+                opt_block(ast->forbody);
+                licm(ast);
+                check_vectorizable(ast);
+                break;
+            case AST_SWITCH:
+                opt_block(ast->swbody);
+                break;
+        }
+    }
+}
+
+void optimize(Ast *func) {
+    cur_func = func;
+    ntemps = 0;
+    last_local = NULL;
+    for(Ast *v = func->localvars; v; v = v->next)
+        last_local = v;
+    // 整个函数里取过地址的变量
+    clear_vars(&addr_taken);
+    Writes all = {{NULL, 0, 0}, false, false};
+    collect_block(func->body, &all);
+    clear_vars(&all.vars);
+    propagate(func);
+    opt_block(func->body);
+}
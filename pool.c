@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cc.h"
+
+// 后端按函数并行用的线程池。任务是0..n-1的编号，先平均分给每个线程，
+// 自己的做完了就从剩得最多的线程那里从尾部偷一半
+
+typedef struct {
+    pthread_mutex_t lock;
+    int lo;     // 自己从头往后取
+    int hi;     // 别人从尾部偷
+} Deque;
+
+typedef struct {
+    Deque *deques;
+    int nworkers;
+    void (*fn)(int task, void *arg);
+    void *arg;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} Worker;
+
+static int nthreads = 0;
+
+void set_threads(int n) {
+    nthreads = n;
+}
+
+static bool take_own(Deque *d, int *task) {
+    pthread_mutex_lock(&d->lock);
+    bool ok = d->lo < d->hi;
+    if(ok)
+        *task = d->lo++;
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+// 偷到的任务放进自己的队列，返回false说明所有队列都空了
+static bool steal(Pool *pool, int self) {
+    for(;;) {
+        int victim = -1;
+        int most = 0;
+        for(int i = 0; i < pool->nworkers; i++) {
+            if(i == self)
+                continue;
+            Deque *d = &pool->deques[i];
+            pthread_mutex_lock(&d->lock);
+            int left = d->hi - d->lo;
+            pthread_mutex_unlock(&d->lock);
+            if(left > most) {
+                victim = i;
+                most = left;
+            }
+        }
+        if(victim < 0)
+            return false;
+        Deque *v = &pool->deques[victim];
+        // 挑完之后可能又被别人取走了，按现在剩下的算
+        pthread_mutex_lock(&v->lock);
+        int left = v->hi - v->lo;
+        int n = (left + 1) / 2;
+        int hi = v->hi;
+        v->hi -= n;
+        pthread_mutex_unlock(&v->lock);
+        if(n == 0)
+            continue;
+        Deque *d = &pool->deques[self];
+        pthread_mutex_lock(&d->lock);
+        d->lo = hi - n;
+        d->hi = hi;
+        pthread_mutex_unlock(&d->lock);
+        return true;
+    }
+}
+
+static void *work(void *p) {
+    Worker *w = p;
+    Pool *pool = w->pool;
+    int task;
+    for(;;) {
+        while(take_own(&pool->deques[w->id], &task))
+            pool->fn(task, pool->arg);
+        if(!steal(pool, w->id))
+            return NULL;
+    }
+}
+
+static int default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// 对0..n-1的每个编号调用fn，全部做完才返回。顺序不定，fn之间不能共享状态
+void run_parallel(int n, void (*fn)(int task, void *arg), void *arg) {
+    int nworkers = nthreads ? nthreads : default_threads();
+    if(nworkers > n)
+        nworkers = n;
+    if(nworkers <= 1) {
+        for(int i = 0; i < n; i++)
+            fn(i, arg);
+        return;
+    }
+    Pool pool = {malloc(sizeof(Deque) * nworkers), nworkers, fn, arg};
+    for(int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].lo = (long)n * i / nworkers;
+        pool.deques[i].hi = (long)n * (i + 1) / nworkers;
+    }
+    pthread_t *threads = malloc(sizeof(pthread_t) * nworkers);
+    Worker *workers = malloc(sizeof(Worker) * nworkers);
+    // 调用的线程自己当0号
+    for(int i = 0; i < nworkers; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if(i && pthread_create(&threads[i], NULL, work, &workers[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    work(&workers[0]);
+    for(int i = 1; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    for(int i = 0; i < nworkers; i++)
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    free(workers);
+    free(threads);
+    free(pool.deques);
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cc.h"
+
+// 插桩模式：每个if有两个计数器，[0]是then执行的次数，[1]是if执行的总次数，
+// else的次数就是两者之差。程序退出时写成下面的文本格式：
+//   cc-profile <if的个数>
+//   <id> <then> <total>
+static char *gen_path = NULL;
+
+// -fprofile-use读进来的计数
+static long *counts = NULL;
+static int ncounts = 0;
+
+void profile_generate(char *path) {
+    gen_path = path;
+}
+
+bool profile_generating(void) {
+    return gen_path != NULL;
+}
+
+void profile_use(char *path, int nif) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) {
+        perror(path);
+        return;
+    }
+    int n;
+    if(fscanf(fp, "cc-profile %d", &n) != 1) {
+        fprintf(stderr, "%s: not a profile\n", path);
+        fclose(fp);
+        return;
+    }
+    if(n != nif) {
+        // 源文件已经改过了，按id对不上
+        fprintf(stderr, "%s: profile does not match the source, ignored\n", path);
+        fclose(fp);
+        return;
+    }
+    counts = calloc(n * 2, sizeof(long));
+    ncounts = n;
+    int id;
+    long then, total;
+    while(fscanf(fp, "%d %ld %ld", &id, &then, &total) == 3) {
+        if(id < 0 || id >= n)
+            continue;
+        counts[id * 2] = then;
+        counts[id * 2 + 1] = total;
+    }
+    fclose(fp);
+}
+
+bool profile_lookup(int id, long *then, long *total) {
+    if(!counts || id >= ncounts || counts[id * 2 + 1] == 0)
+        return false;
+    *then = counts[id * 2];
+    *total = counts[id * 2 + 1];
+    return true;
+}
+
+void emit_profile_counter(int id, int which) {
+    emitf("\tincq .Lprof_counts+%d(%%rip)\n", id * 16 + which * 8);
+}
+
+void emit_profile_register(void) {
+    emitf("\tlea .Lprof_dump(%%rip), %%rdi\n");
+    emitf("\tcall atexit\n");
+}
+
+// 计数器放在.bss，退出时由atexit注册的.Lprof_dump写文件
+void emit_profile_runtime(int nif) {
+    if(!gen_path)
+        return;
+    int n = nif ? nif : 1;
+    printf("\t.local .Lprof_counts\n");
+    printf("\t.comm .Lprof_counts, %d, 8\n", n * 16);
+    printf("\t.section .rodata\n");
+    // 路径里的"和\也要转义
+    printf(".Lprof_path:\n\t.string ");
+    emit_quote(gen_path, strlen(gen_path));
+    printf("\n");
+    printf(".Lprof_mode:\n\t.string \"w\"\n");
+    printf(".Lprof_head:\n\t.string \"cc-profile %d\\n\"\n", nif);
+    printf(".Lprof_line:\n\t.string \"%%d %%ld %%ld\\n\"\n");
+    printf("\t.text\n");
+    printf(".Lprof_dump:\n");
+    printf("\tpush %%rbp\n\tmov %%rsp, %%rbp\n\tpush %%rbx\n\tpush %%r12\n");
+    printf("\tlea .Lprof_path(%%rip), %%rdi\n\tlea .Lprof_mode(%%rip), %%rsi\n");
+    printf("\tcall fopen\n\ttest %%rax, %%rax\n\tje .Lprof_done\n");
+    printf("\tmov %%rax, %%r12\n");
+    printf("\tmov %%r12, %%rdi\n\tlea .Lprof_head(%%rip), %%rsi\n");
+    printf("\tmov $0, %%eax\n\tcall fprintf\n");
+    printf("\txor %%ebx, %%ebx\n");
+    printf(".Lprof_loop:\n");
+    printf("\tcmp $%d, %%ebx\n\tjge .Lprof_close\n", nif);
+    printf("\tmov %%rbx, %%rax\n\tshl $4, %%rax\n");
+    printf("\tlea .Lprof_counts(%%rip), %%rcx\n");
+    printf("\tmov 8(%%rcx,%%rax), %%r8\n\tmov (%%rcx,%%rax), %%rcx\n");
+    printf("\tmov %%ebx, %%edx\n\tmov %%r12, %%rdi\n\tlea .Lprof_line(%%rip), %%rsi\n");
+    printf("\tmov $0, %%eax\n\tcall fprintf\n");
+    printf("\tinc %%ebx\n\tjmp .Lprof_loop\n");
+    printf(".Lprof_close:\n\tmov %%r12, %%rdi\n\tcall fclose\n");
+    printf(".Lprof_done:\n\tpop %%r12\n\tpop %%rbx\n\tpop %%rbp\n\tret\n");
+}
@@ -0,0 +1,114 @@
+#!/bin/bash
+
+# 伸缩性回归测试：每种输入按几何级数放大，测cc各阶段的耗时和需要的栈，
+# 用最小二乘拟合log(耗时)对log(规模)的斜率，超过线性就失败。
+# 栈用ulimit -s二分出能编译过的最小值，平铺的输入(声明、表达式长度、
+# 字面量、函数个数)不允许随规模增长，嵌套深度允许线性增长。
+#   <输入> <阶段> <拟合的指数> <最大规模的耗时ms> ok|FAIL
+#   <输入> stack <最小规模KB> <最大规模KB> <指数> ok|FAIL
+
+MAX_EXP=${MAX_EXP:-1.3}     # 耗时指数的上限
+MIN_MS=${MIN_MS:-3}         # 比这个快的点误差太大，不参与拟合
+RUNS=${RUNS:-7}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+make -s cc || exit 1
+
+# 生成规模为$2的输入$1
+function gen {
+	case $1 in
+		decls)
+			# 每个声明都引用前一个变量
+			awk -v n=$2 'BEGIN { print "int v0=1;"; for(i = 1; i < n; i++) printf "int v%d=v%d+1;\n", i, i - 1; printf "v%d;\n", n - 1 }' ;;
+		exprlen)
+			# 参数的值不知道，折叠不掉，要一直生成到代码
+			awk -v n=$2 'BEGIN { printf "int f(int x){return x"; for(i = 1; i < n; i++) printf "+x"; print ";}f(1);" }' ;;
+		literals)
+			awk -v n=$2 'BEGIN { for(i = 0; i < n; i++) printf "\"lit%d\";%d;\n", i, i; print "0;" }' ;;
+		funcs)
+			awk -v n=$2 'BEGIN { for(i = 0; i < n; i++) printf "int f%d(int a){return a+%d;}\n", i, i % 7;
+				print "int t=0;"; for(i = 0; i < n; i++) printf "t=f%d(t);\n", i; print "t;" }' ;;
+		nesting)
+			awk -v n=$2 'BEGIN { print "int x=0;"; for(i = 0; i < n; i++) printf "if(x<%d){", i + 1;
+				printf "x=x+1;"; for(i = 0; i < n; i++) printf "}"; print "x;" }' ;;
+	esac
+}
+
+# 各输入的规模：起点、放大的次数
+function sizes {
+	case $1 in
+		nesting) echo 1000 2000 4000 8000 ;;
+		*) echo 4000 8000 16000 32000 64000 ;;
+	esac
+}
+
+# 运行RUNS次，每个阶段取最短的，输出"parse optimize codegen"的毫秒数
+function phase_ms {
+	for ((r = 0; r < RUNS; r++)); do
+		./cc -j1 -ftime-report < "$1" 2>&1 > /dev/null | grep -E '^(parse|optimize|codegen) '
+	done | awk '{ t = $2 * 1000; if(!($1 in best) || t < best[$1]) best[$1] = t }
+		END { printf "%f %f %f\n", best["parse"], best["optimize"], best["codegen"] }'
+}
+
+# 能编译$1的最小栈(KB)
+function min_stack {
+	lo=16
+	hi=262144
+	if ! (ulimit -s $hi; ./cc -j1 < "$1" > /dev/null 2>&1) 2> /dev/null; then
+		echo $hi
+		return
+	fi
+	while [ $((hi - lo)) -gt $((lo / 16 + 1)) ]; do
+		mid=$(( (lo + hi) / 2 ))
+		if (ulimit -s $mid; ./cc -j1 < "$1" > /dev/null 2>&1) 2> /dev/null; then
+			hi=$mid
+		else
+			lo=$mid
+		fi
+	done
+	echo $hi
+}
+
+# 从"规模 耗时"的行拟合指数
+function fit {
+	awk -v min=$MIN_MS '$2 >= min { x = log($1); y = log($2); n++; sx += x; sy += y; sxx += x * x; sxy += x * y }
+		END { if(n < 3) { print "-"; exit } printf "%.2f\n", (n * sxy - sx * sy) / (n * sxx - sx * sx) }'
+}
+
+status=0
+for input in decls exprlen literals funcs nesting; do
+	: > "$dir/times"
+	first=
+	last=
+	for n in $(sizes $input); do
+		gen $input $n > "$dir/in.c"
+		echo "$n $(phase_ms "$dir/in.c")" >> "$dir/times"
+		[ -z "$first" ] && { first=$n; cp "$dir/in.c" "$dir/first.c"; }
+		last=$n
+	done
+	for col in 2 3 4; do
+		phase=$(echo parse optimize codegen | cut -d' ' -f$((col - 1)))
+		e=$(awk -v c=$col '{ print $1, $c }' "$dir/times" | fit)
+		ms=$(tail -1 "$dir/times" | awk -v c=$col '{ print $c }')
+		verdict=ok
+		if [ "$e" != "-" ] && awk "BEGIN { exit !($e > $MAX_EXP) }"; then
+			verdict=FAIL
+			status=1
+		fi
+		printf "%-10s %-9s %6s %9.1f %s\n" $input $phase "$e" $ms $verdict
+	done
+
+	s1=$(min_stack "$dir/first.c")
+	s2=$(min_stack "$dir/in.c")
+	max=0.2
+	[ $input = nesting ] && max=1.2
+	e=$(awk -v a=$s1 -v b=$s2 -v n1=$first -v n2=$last 'BEGIN { printf "%.2f", log(b / a) / log(n2 / n1) }')
+	verdict=ok
+	if awk "BEGIN { exit !($e > $max) }"; then
+		verdict=FAIL
+		status=1
+	fi
+	printf "%-10s %-9s %6s %9s %s (%d KB -> %d KB)\n" $input stack "$e" - $verdict $s1 $s2
+done
+exit $status
@@ -16,11 +16,8 @@ String *make_string(void) {
 }
 
 static void realloc_body(String *s) {
-	int newsize = s->nalloc * 2;
-	char *body = malloc(newsize);
-	strcpy(body, s->body);
-	s->body = body;
-	s->nalloc = newsize;
+	s->nalloc *= 2;
+	s->body = realloc(s->body, s->nalloc);
 }
 
 char *get_cstring(String *s) {
@@ -34,17 +31,25 @@ void string_append(String *s, char c) {
 	s->body[s->len] = '\0';
 }
 
-void string_appendf(String *s, char *fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
+void string_vappendf(String *s, char *fmt, va_list args) {
 	for (;;) {
 		int avail = s->nalloc - s->len;
-		int written = vsnprintf(s->body + s->len, avail, fmt, args);
+		va_list copy;
+		va_copy(copy, args);
+		int written = vsnprintf(s->body + s->len, avail, fmt, copy);
+		va_end(copy);
 		if(avail <= written) {
 			realloc_body(s);
 			continue;
 		}
-		s->len += written + 1;
+		s->len += written;
 		return;
 	}
+}
+
+void string_appendf(String *s, char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	string_vappendf(s, fmt, args);
+	va_end(args);
 }
\ No newline at end of file
@@ -4,6 +4,27 @@ function testast {
 	result="$(echo "$1" | ./cc -a)"
 	echo "${result}"
 }
+
+# -a输出的Ast要和$1一样
+function testastout {
+	result="$(echo "$2" | ./cc -a)"
+	if [ "$result" != "$1" ]; then
+		echo "AST test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+# 编译成汇编，链接后运行，比较main的返回值
+function test {
+	echo "$2" | ./cc > tmp.s || { echo "Failed to compile $2"; exit 1; }
+	gcc -o tmp.out tmp.s || { echo "GCC failed: $2"; exit 1; }
+	./tmp.out
+	result=$?
+	if [ "$result" != "$1" ]; then
+		echo "Test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
 make -s cc
 
 # testast '"java";'
@@ -29,3 +50,255 @@ make -s cc
 # testast 'char *s="abc"'
 # testast 'int varaaa[3]={1,2,3};'
 testast 'if(1){2;}else{3;}'
+
+# 先插桩运行一遍生成profile，再按profile重新编译，结果要一样
+function testprof {
+	echo "$2" | ./cc -fprofile-generate=tmp.prof > tmp.s && gcc -o tmp.out tmp.s && ./tmp.out
+	echo "$2" | ./cc -fprofile-use=tmp.prof > tmp.s && gcc -o tmp.out tmp.s
+	./tmp.out
+	result=$?
+	rm -f tmp.prof
+	if [ "$result" != "$1" ]; then
+		echo "Test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+# 不经过汇编器，直接在cc进程里执行
+function testjit {
+	echo "$2" | ./cc -jit
+	result=$?
+	if [ "$result" != "$1" ]; then
+		echo "JIT test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+# 头文件都写在tmp.inc里，用-I找到
+function testcpp {
+	echo "$2" | ./cc -Itmp.inc > tmp.s || { echo "Failed to compile $2"; exit 1; }
+	gcc -o tmp.out tmp.s || { echo "GCC failed: $2"; exit 1; }
+	./tmp.out
+	result=$?
+	if [ "$result" != "$1" ]; then
+		echo "Test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+# 后端多线程生成的汇编要和单线程的一模一样
+function testpar {
+	echo "$2" | ./cc -j1 > tmp.s || { echo "Failed to compile $2"; exit 1; }
+	echo "$2" | ./cc -j4 > tmp2.s || { echo "Failed to compile $2"; exit 1; }
+	cmp -s tmp.s tmp2.s || { echo "Parallel output differs: $2"; exit 1; }
+	rm -f tmp2.s
+	gcc -o tmp.out tmp.s || { echo "GCC failed: $2"; exit 1; }
+	./tmp.out
+	result=$?
+	if [ "$result" != "$1" ]; then
+		echo "Test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+# 每行一块并行切分，汇编和报的错都要和顺序切分的一样
+function testlex {
+	echo "$2" | ./cc -flex-chunk=0 > tmp.s 2> tmp.err || { echo "Failed to compile $2"; exit 1; }
+	echo "$2" | ./cc -flex-chunk=1 -j4 > tmp2.s 2> tmp2.err || { echo "Failed to compile $2"; exit 1; }
+	cmp -s tmp.s tmp2.s && cmp -s tmp.err tmp2.err || { echo "Parallel lexing differs: $2"; exit 1; }
+	rm -f tmp2.s tmp.err tmp2.err
+	gcc -o tmp.out tmp.s || { echo "GCC failed: $2"; exit 1; }
+	./tmp.out
+	result=$?
+	if [ "$result" != "$1" ]; then
+		echo "Test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+# 编译两次，第二次要从tmp.cache里直接拿，输出和不用缓存的一样
+function testcache {
+	echo "$2" | ./cc > tmp2.s || { echo "Failed to compile $2"; exit 1; }
+	echo "$2" | ./cc -fcache-dir=tmp.cache > /dev/null
+	echo "$2" | ./cc -fcache-dir=tmp.cache > tmp.s
+	cmp -s tmp.s tmp2.s || { echo "Cached output differs: $2"; exit 1; }
+	rm -f tmp2.s
+	gcc -o tmp.out tmp.s || { echo "GCC failed: $2"; exit 1; }
+	./tmp.out
+	result=$?
+	if [ "$result" != "$1" ]; then
+		echo "Test failed: $2 expected $1 but got $result"
+		exit 1
+	fi
+}
+
+test 5 '1+2-6+8;'
+test 14 '1*2+3*4;'
+test 9 '(1+2)*3;'
+test 7 'int a=3;int *b=&a;*b=7;a;'
+test 20 'int a;int b;a=b=10;a+b'
+test 3 'if(0){2;}else{3;}'
+test 2 'int t[]={1,0,2,0,0};*(t+2);'
+test 6 'int t[8]={5,6};*(t+1)+*(t+7);'
+test 3 'int a[3]={1,0-7,3}; *(a+1)+10;'
+test 6 'int a[3]={1+1,2*2,(3)}; *(a+0)+*(a+1)-*(a+2)+3;'
+test 99 "char a[2]={'a','b'+1}; *(a+1);"
+test 98 'char s[4]="abc";*(s+1);'
+test 111 'char *a="hello";char *b="lo";char *c="hello";*(b+1)+*(c+4)-*(a+4);'
+
+test 7 'int add(int a,int b){return a+b;} add(3,4);'
+test 55 'int f(int n){if(n){return n+f(n-1);} return 0;} f(10);'
+test 191 'int f(int a,int b,int c,int d,int e,int f,int g,int h){return a+b+c+d+e+f+g*10+h*100;} f(1,2,3,4,5,6,7,1);'
+test 121 'char g(char *s){return *(s+1);} g("xyz");'
+test 42 'int main(){return 42;}'
+test 5 'strlen("hello");'
+
+test 1 'int a=4;int b=5;if(a<b && b<6){1;}else{2;}'
+test 1 'int a=4;int b=5;if(a>b || b>=5){1;}else{2;}'
+test 7 'int a=0;if(!a){7;}else{8;}'
+test 0 'int a=4;(a>2)&&(a<3);'
+test 1 'char *p=0;p==0;'
+test 4 'int a=4;if(0 && a){a=9;} a;'
+
+testjit 14 '1*2+3*4;'
+testjit 6 'int t[8]={5,6};*(t+1)+*(t+7);'
+testjit 121 'char g(char *s){return *(s+1);} g("xyz");'
+testjit 191 'int f(int a,int b,int c,int d,int e,int f,int g,int h){return a+b+c+d+e+f+g*10+h*100;} f(1,2,3,4,5,6,7,1);'
+testjit 109 'int f(int n){if(n<2){return n;} return f(n-1)+f(n-2);} f(20);'
+testjit 5 'strlen("hello");'
+testjit 202 'int f(int x){int r=0;switch(x){case 1:r=10;break;case 2:r=20;case 3:r=r+3;break;case 4:r=40;break;case 5:r=50;break;case 100:r=7;break;case 200:r=8;break;case 300:r=9;break;case 0-7:r=1;break;default:r=99;}return r;} f(1)+f(2)+f(3)+f(5)+f(100)+f(300)+f(0-7)+f(6);'
+test 42 'int x=7;x*6;'
+test 45 'int x=5;x*9;'
+test 99 'int x=9;x*11;'
+test 14 'int x=100;x/7;'
+test 2 'int x=100;x%7;'
+test 6 'int x=0-7;x/(0-2)+x%(0-2)+4;'
+test 253 'int x=0-17;int q=x/4;q*0-q+x%4+250;'
+test 1 '7%3;'
+testjit 1 '7%3;'
+testjit 12 'int x=47;x/8+x%8+x*0;'
+test 10 "'\\n';"
+test 92 "'\\\\';"
+test 4 'strlen("a\tb\n");'
+test 34 'char s[]="x\"y";*(s+1);'
+testjit 9 "'\\t';"
+testastout '(for (decl int i 0) (< i 3) (=i (+ i 1)) {i;})' 'for(int i=0;i<3;i=i+1){i;}'
+testastout '(while 1 {2;})' 'while(1){2;}'
+test 45 'int s=0;for(int i=0;i<10;i=i+1){s=s+i;}s;'
+test 10 'int i=0;while(i<10){i=i+1;}i;'
+# a*b不随循环变，乘法要提到循环前面，第一个标签(循环体)之前
+licm='int f(int n,int a,int b){int s=0;for(int i=0;i<n;i=i+1){s=s+a*b;}return s;} f(3,4,5);'
+test 60 "$licm"
+echo "$licm" | ./cc | sed -n '/^f:/,/^\tret/p' | awk '/^\.L/ { body = 1 } /imul/ { if(body) bad = 1; else pre = 1 } END { exit !(pre && !bad) }' ||
+	{ echo "Loop invariant was not hoisted: $licm"; exit 1; }
+test 8 'int f(int n){int i=0;for(;;){if(i*i>n){return i;}i=i+1;}} f(50);'
+test 133 'int k=3;int m=4;int a[10];for(int i=0;i<10;i=i+1){*(a+i)=i*(k*m+1)+2*3;}int s=0;int j=0;while(j<10){s=s+*(a+j);j=j+1;}s%256;'
+test 54 'int x=7;int *q=&x;int t=0;for(int i=0;i<3;i=i+1){*q=*q+1;t=t+x*2;}t;'
+testjit 170 'int s=0;for(int i=0;i<5;i=i+1){int k=i*2;for(int j=0;j<4;j=j+1){s=s+k+j*(i+1);}}s;'
+test 202 "int f(int c){if(c){int a=c*2;char x='a';return a+x;}else{int b=c+5;char y='b';return b+y;}} f(1)+f(0);"
+test 62 'int g(){int s=0;for(int i=0;i<5;i=i+1){int t=i*3;s=s+t;}int u=s+1;int v=u*2;return v;} g();'
+testjit 238 'int f(int c){if(c){int a=c*2;return a;}else{int b=c+5;return b;}} char p=112;char q=113;int arr[5]={1,2,3,4,5};int k=0;for(int i=0;i<3;i=i+1){int t=*(arr+i);k=k+t;}(f(1)+f(0)+p+q+k)%256;'
+test 14 'int a=3;int b=a+4;b*2;'
+test 6 'int a=5;int b=a;if(b>3){a=1;}else{a=1;}a+b;'
+test 44 'char c=300;c+0;'
+test 8 'int k=2;int s=0;for(int i=0;i<4;i=i+1){s=s+k;}s;'
+test 8 'int x=1;int i=0;while(i<3){x=x*2;i=i+1;}x;'
+test 1 'int a=1;int b=a;a=5;b;'
+test 9 'int h(int *p){*p=9;return 1;} int g=0;int t=h(&g);g;'
+testjit 12 'int a=2;int b=a;int c=b*3;if(c>5){b=c;}else{b=c;}b+c;'
+test 1 'int f(int x){int a=1; return (a=x) && a==x;} f(5);'
+test 1 'int a=1; int b=(a=5) && (a==5); b;'
+test 253 'int a[37];int b[37];int k=0-5;for(int i=0;i<37;i=i+1){*(a+i)=k;}for(int i=0;i<37;i=i+1){*(b+i)=*(a+i)*2+7;}*(b+36);'
+test 4 'char c[21];char d[21];for(int i=0;i<21;i=i+1){*(c+i)=100;}for(int i=0;i<21;i=i+1){*(d+i)=*(c+i)+*(c+i)+60;}*(d+20);'
+test 222 'int dot(int *a,int *b,int n){int s=0;for(int i=0;i<n;i=i+1){s=s+*(a+i)**(b+i);}return s;} int a[37];int b[37];for(int i=0;i<37;i=i+1){*(a+i)=2;*(b+i)=3;}dot(a,b,37)%256;'
+test 30 'int cp(int *d,int *s,int n){for(int i=0;i<n;i=i+1){*(d+i)=*(s+i)+1;}return 0;} int a[40];for(int i=0;i<40;i=i+1){*(a+i)=0;}cp(a+1,a,30);*(a+30)+*(a+31);'
+testjit 253 'int a[37];int b[37];int k=0-5;for(int i=0;i<37;i=i+1){*(a+i)=k;}for(int i=0;i<37;i=i+1){*(b+i)=*(a+i)*2+7;}*(b+36);'
+
+mkdir -p tmp.inc
+printf '#ifndef G_H\n#define G_H\nint g(){return 7;}\n#endif\n' > tmp.inc/g.h
+printf '#pragma once\nint o(){return 5;}\n' > tmp.inc/o.h
+printf '#include "g.h"\n#define SQ(x) ((x)*(x))\n' > tmp.inc/sq.h
+testcpp 12 $'#include <g.h>\n#include "tmp.inc/g.h"\n#include <o.h>\n#include <o.h>\ng()+o();'
+testcpp 16 $'#include <sq.h>\n#define ADD(a,b) ((a)+(b))\n#define F(x) x\nF(F(ADD(SQ(3),g())));'
+testcpp 1 $'#define SELF SELF\nint SELF=1;SELF;'
+# 带#else的不是include guard，第二次包含要展开#else那边
+printf '#ifndef GE_H\n#define GE_H\nint a=1;\n#else\na=a+40;\n#endif\n' > tmp.inc/ge.h
+testcpp 41 $'#include <ge.h>\n#include <ge.h>\na;'
+testcpp 4 $'#define N 2\n#if defined(N) && N*2==4\nint x=4;\n#elif 1\nint x=5;\n#else\nint x=6;\n#endif\nx;'
+testcpp 6 $'#define N 2\n#undef N\n#ifdef N\nint x=4;\n#else\nint x=6; /* c */\n#endif\nx; // c'
+rm -rf tmp.inc
+
+testpar 47 'int a(int n){if(n>2){return n*2;}return 1;} int b(int n){int s=0;for(int i=0;i<n;i=i+1){s=s+i;}return s;} int c(){char *p="xy";return *(p+1)-100;} int d(int n){while(n>10){n=n-7;}return n;} a(3)+b(5)+c()+d(30)+a(1)+b(1);'
+
+test 27 'int f(int *p, int i){ *(p+i) = *(p+i) + 3; *(p+2) = 5; return *(p+i+1) + *&i; } int h(){ int a[8]; int i = 2; *(a+i) = 4; *(a+3) = 1; i = i + 5; char c = 3; c = c - 1; int *q = a + 1; q = q + 2; return *(a+i-5) + *(a+3) + c + *q; } int b[4]; *(b+1) = 10; *(b+2) = 20; f(b, 1) + h() + *(b+1);'
+test 130 'char c=120;c=c+10;c;'
+# 直接加在内存上的常数要截成char，汇编器不能有警告
+rmw='int f(char c){c=c+1000;return c;} char d=5;d=d-300;f(1)+d-217;'
+test 233 "$rmw"
+echo "$rmw" | ./cc > tmp.s && [ -z "$(gcc -c -o tmp.o tmp.s 2>&1)" ] || { echo "Assembler warned: $rmw"; exit 1; }
+rm -f tmp.o
+test 15 'int f(int *a,int i){*(a+i)=5;*(a+i)=*(a+i)*2+*(a+i);return *(a+i+0);} int a[4];f(a,1);'
+test 102 'int f(char *s,int i){int x=2;x=x-*(s+i);*(s+i+1)=0-7;return x+*(s+i+1)+*(s+2);} char s[4]="abc";f(s,0)+105;'
+# 选的是代价最小的tiling：index便宜的时候*(a+i)是一个带index的操作数，贵了就分开算
+tile='int f(int i){int a[4]={1,2,3,4};return *(a+i);} f(2);'
+test 3 "$tile"
+echo "$tile" | ./cc | sed -n '/^f:/,/^\tret/p' | grep -q ',%rcx,4)' || { echo "Indexed operand not selected: $tile"; exit 1; }
+echo "$tile" | ./cc -fcost-index=100 | sed -n '/^f:/,/^\tret/p' | grep -q ',4)' && { echo "Expensive index still selected: $tile"; exit 1; }
+echo "$tile" | ./cc -fcost-index=100 > tmp.s && gcc -o tmp.out tmp.s && ./tmp.out
+[ $? = 3 ] || { echo "-fcost-index=100 miscompiled: $tile"; exit 1; }
+
+test 67 'int f(int n){if(n<2){return n;}int a=f(n-1);int b=f(n-2);return a+b;} int g(char c,int *p,int k){int s=0;char d=c;int *q=p;for(int i=0;i<k;i=i+1){s=s+*(q+i)+d;d=d+1;}return s;} int a[3]={1,2,3};f(10)+g(1,a,3)+0*(f(1)+f(2));'
+test 62 'int h(int *p){*p=*p+1;return 2;} int f(int n){int x=1;int y=2;int z=3;int u=4;int v=5;int w=6;int t=0;for(int i=0;i<n;i=i+1){t=t+x+y+z+u+v+w;}int m=7;t=t+h(&m);t=t+m;return t;} f(1)+f(1);'
+
+# switch：密的case用跳转表，稀疏的二分查找，没有break就落到下一个case
+dense='int f(int x){int r=0;switch(x){case 1:r=10;break;case 2:r=20;case 3:r=r+3;break;case 4:r=40;break;case 5:r=50;break;case 100:r=7;break;case 200:r=8;break;case 300:r=9;break;case 0-7:r=1;break;default:r=99;}return r;} f(1)+f(2)+f(3)+f(5)+f(100)+f(300)+f(0-7)+f(6);'
+sparse='int f(int x){switch(x){case 0-1000:return 1;case 0-3:return 2;case 17:return 3;case 450:return 4;case 9999:return 5;case 123456:return 6;}return 40;} f(0-1000)+f(0-3)+f(17)+f(450)+f(9999)+f(123456)+f(5);'
+test 202 "$dense"
+test 61 "$sparse"
+# 1到5这一段要有.rodata里的跳转表，case全是稀疏的就不该有
+asm="$(echo "$dense" | ./cc)"
+grep -q 'jmp \*' <<< "$asm" && grep -q '\.pushsection \.rodata' <<< "$asm" || { echo "Jump table not emitted: $dense"; exit 1; }
+asm="$(echo "$sparse" | ./cc)"
+grep -q 'jmp \*\|\.rodata' <<< "$asm" && { echo "Jump table emitted for sparse cases: $sparse"; exit 1; }
+test 6 'int x=3;int y=1;switch(x){case 3:y=5;case 4:y=y+1;break;default:y=9;}y;'
+test 25 'int s=0;for(int i=0;i<10;i=i+1){int k=5;switch(i%3){case 0:s=s+k;break;case 1:s=s+1;break;default:s=s-1;}}s+5;'
+test 25 "int f(char c,int y){switch(c){case 'a':switch(y){case 1:return 11;case 2:break;}return 12;case 'b':if(y){break;}return 20;}return 1;} f('a',1)+f('a',2)+f('b',1)+f('z',0)+f('b',0)-20;"
+testastout '(decl int x 2)(switch x {(case 1);(default);x;(break);})' 'int x=2;switch(x){case 1:default:x;break;}'
+
+testprof 13 'int a=1;int b=0;if(a-1){b=2;}else{b=3;}if(a){b=b+10;}if(0){b=b+100;}b;'
+# 路径里的"和\\原样写进汇编的话as不认
+echo 'int a=1;if(a){a=2;}a;' | ./cc '-fprofile-generate=tmp"x\y.prof' > tmp.s && gcc -o tmp.out tmp.s && ./tmp.out
+[ -f 'tmp"x\y.prof' ] || { echo "Profile path was not escaped"; exit 1; }
+rm -f 'tmp"x\y.prof'
+
+# 块的开头落在注释、字符串和字符字面量里面
+testlex 45 'int x=1; /* "a
+b'\'' */ char *s="c /*
+d */ e"; // "
+int y='\''\n'\'';
+x+y+*(s+1)+2;'
+testlex 7 '/*
+*/ int a=3; "\"
+x"; a+
+4;'
+
+rm -rf tmp.cache
+testcache 21 'int f(int n){return n*3;} f(7);'
+[ "$(./cc -fcache-stats -fcache-dir=tmp.cache | head -2 | tr '\n' ' ')" = "hits 1 misses 1 " ] || { echo "Cache was not hit"; exit 1; }
+# 头文件改了就不能再用以前的结果
+mkdir -p tmp.inc
+echo 'int g(){return 7;}' > tmp.inc/g.h
+echo '#include "tmp.inc/g.h"' | ./cc -a -fcache-dir=tmp.cache > /dev/null
+echo 'int g(){return 8;}' > tmp.inc/g.h
+[ "$(echo '#include "tmp.inc/g.h"' | ./cc -a -fcache-dir=tmp.cache)" = "(int g() {(return 8);})" ] || { echo "Stale cache entry used"; exit 1; }
+# 超过大小的上限，最旧的条目被删掉
+for i in 1 2 3 4 5 6; do echo "$i;" | ./cc -fcache-dir=tmp.cache -fcache-max=2000 > /dev/null; done
+[ "$(./cc -fcache-stats -fcache-dir=tmp.cache | awk '$1 == "size" { print ($2 <= 2000) }')" = 1 ] || { echo "Cache is over its size cap"; exit 1; }
+# 报了错的编译不缓存，第二次还要看到诊断
+bad='int a[2]={1,2,3}; *(a+1);'
+echo "$bad" | ./cc -fcache-dir=tmp.cache > /dev/null 2>&1
+[ -n "$(echo "$bad" | ./cc -fcache-dir=tmp.cache 2>&1 > /dev/null)" ] || { echo "Cached compile lost its diagnostics: $bad"; exit 1; }
+rm -rf tmp.cache tmp.inc
+
+rm -f tmp.s tmp.out
+echo "All tests passed"